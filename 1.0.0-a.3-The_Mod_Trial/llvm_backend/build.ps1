@@ -1,14 +1,34 @@
 # Build script for the LLVM backend prototype (Windows PowerShell)
-# Tries clang++ then g++ (assumes either is in PATH)
+# Tries clang++ then g++ (assumes either is in PATH), and llvm-config for the
+# LLVM flags and libraries.
+# Only the native backend is linked by default, which keeps the compiler small
+# and its startup short. -AllTargets links every backend LLVM was built with so
+# that --target <triple> can cross-compile.
+param([switch]$AllTargets)
 
 $src = "xfawac_llvm.cpp"
 $out = "xfawac_llvm.exe"
-Write-Host "Compiling $src -> $out"
+if (-not (Get-Command llvm-config -ErrorAction SilentlyContinue)) {
+    Write-Error "No llvm-config found in PATH"
+    exit 1
+}
+$components = @("core", "support", "mc", "target", "codegen", "passes", "transformutils", "bitreader", "bitwriter", "ipo", "lto", "orcjit", "native")
+$defines = @()
+if ($AllTargets) {
+    $components += "all-targets"
+    $defines += "-DXF_ALL_TARGETS"
+}
+$cxxflags = (llvm-config --cxxflags) -split '\s+' | Where-Object { $_ }
+$ldflags = (llvm-config --ldflags) -split '\s+' | Where-Object { $_ }
+$libs = (llvm-config --libs $components) -split '\s+' | Where-Object { $_ }
+$syslibs = (llvm-config --system-libs $components) -split '\s+' | Where-Object { $_ }
+
+Write-Host "Compiling $src -> $out (LLVM components: $($components -join ' '))"
 if (Get-Command clang++ -ErrorAction SilentlyContinue) {
-    clang++ -std=c++17 -O2 $src -o $out
+    clang++ -std=c++17 -O2 @cxxflags @defines $src -o $out @ldflags @libs @syslibs
 } else {
     if (Get-Command g++ -ErrorAction SilentlyContinue) {
-        g++ -std=c++17 -O2 $src -o $out
+        g++ -std=c++17 -O2 @cxxflags @defines $src -o $out @ldflags @libs @syslibs
     } else {
         Write-Error "No clang++ or g++ found in PATH"
         exit 1
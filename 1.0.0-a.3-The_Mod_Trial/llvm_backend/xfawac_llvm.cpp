@@ -7,22 +7,45 @@
 #include <cstring>
 #include <string>
 #include <vector>
-#include <fstream>
-#include <sstream>
-#include <iostream>
 #include <ctime>
 #include <cctype>
 #include <memory>
+#include <cstdarg>
+#include <chrono>
+#include <thread>
+#include <algorithm>
 
 #ifdef _WIN32
 #include <windows.h>
 #include <io.h>
 #include <direct.h>
+#include <process.h>
 #else
 #include <dirent.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <signal.h>
+#include <cerrno>
 #endif
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Triple.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
@@ -32,8 +55,23 @@
 #include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/GlobalIFunc.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Config/llvm-config.h"
+#if LLVM_VERSION_MAJOR >= 14
+#include "llvm/MC/TargetRegistry.h"
+#else
 #include "llvm/Support/TargetRegistry.h"
+#endif
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
 #include "llvm/Support/FileSystem.h"
@@ -42,11 +80,36 @@
 #include "llvm/Support/CodeGen.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/CodeGen/Passes.h"
-#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Transforms/IPO/ThinLTOBitcodeWriter.h"
+#include "llvm/LTO/LTO.h"
+#include "llvm/Support/Caching.h"
+#include "llvm/Support/CachePruning.h"
 #include "llvm/Support/Error.h"
 #include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/DJB.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 
 using namespace llvm;
+using orc::ThreadSafeModule;
+
+#ifndef _WIN32
+extern char** environ;
+#endif
 
 // 全局标志用于控制行为
 static int g_debug = 0;
@@ -55,14 +118,76 @@ static const char* VERSION = "1.0.0-a.3";
 
 #define DEBUG_LOG(...) do { if (g_debug) std::fprintf(stderr, "[debug] " __VA_ARGS__); } while(0)
 
-static void InitializeLLVMTargets() {
-    InitializeAllTargetInfos();
-    InitializeAllTargets();
-    InitializeAllTargetMCs();
-    InitializeAllAsmParsers();
-    InitializeAllAsmPrinters();
+// Only the backend a compile needs is initialized: the host's by default, and
+// with --target the one owning that triple. Builds with -DXF_ALL_TARGETS link
+// every backend LLVM was configured with and can cross-compile; the default
+// build links only the native one (see build.ps1).
+#ifdef XF_ALL_TARGETS
+struct TargetInit {
+    void (*info)();
+    void (*target)();
+    void (*mc)();
+    void (*printer)();
+};
+#define LLVM_TARGET(T) {LLVMInitialize##T##TargetInfo, LLVMInitialize##T##Target, LLVMInitialize##T##TargetMC, LLVMInitialize##T##AsmPrinter},
+static const TargetInit AllTargets[] = {
+#include "llvm/Config/Targets.def"
+};
+#endif
+
+static const Target* InitializeTargetFor(const std::string& triple, std::string& err) {
+    static bool native_done = false;
+    if (!native_done) {
+        native_done = true;
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        // inline asm (the --multiversion resolver) is assembled by the target's parser
+        InitializeNativeTargetAsmParser();
+    }
+    if (const Target* T = TargetRegistry::lookupTarget(triple, err)) return T;
+#ifdef XF_ALL_TARGETS
+    // registering a TargetInfo is cheap; register them one at a time until
+    // one claims the triple, then bring up just that backend
+    for (const TargetInit& t : AllTargets) {
+        t.info();
+        std::string ignored;
+        if (const Target* T = TargetRegistry::lookupTarget(triple, ignored)) {
+            t.target();
+            t.mc();
+            t.printer();
+            return T;
+        }
+    }
+#else
+    err += " (this build only includes the native target; rebuild with XF_ALL_TARGETS to cross-compile)";
+#endif
+    return nullptr;
 }
 
+// --time-phases: wall-clock time spent in each compiler phase, on stderr
+struct PhaseTimer {
+    bool enabled = false;
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+    std::vector<std::pair<const char*, double>> phases;
+
+    void mark(const char* name) {
+        if (!enabled) return;
+        auto now = std::chrono::steady_clock::now();
+        phases.emplace_back(name, std::chrono::duration<double, std::milli>(now - last).count());
+        last = now;
+    }
+    ~PhaseTimer() { report(); }
+    void report() const {
+        if (!enabled || phases.empty()) return;
+        double total = 0;
+        for (const auto& p : phases) {
+            std::fprintf(stderr, "  %-12s %9.3f ms\n", p.first, p.second);
+            total += p.second;
+        }
+        std::fprintf(stderr, "  %-12s %9.3f ms\n", "total", total);
+    }
+};
+
 static Function* CreatePrintUTF8Function(Module* M, IRBuilder<>* Builder) {
     LLVMContext& Context = M->getContext();
     FunctionType* FT = FunctionType::get(Type::getVoidTy(Context), 
@@ -78,204 +203,302 @@ static Function* CreatePrintUTF8Function(Module* M, IRBuilder<>* Builder) {
     Builder->CreateRetVoid();
     return F;
 }
-struct ModMap {
-    std::string from;
-    std::string to;
-};
 
-static std::string read_file_safely(const std::string& path) {
-    std::ifstream f(path, std::ios::binary);
-    if (!f) return "";
-    f.seekg(0, std::ios::end);
-    size_t sz = f.tellg();
-    if (sz == 0 || sz > 65536) return "";
-    f.seekg(0, std::ios::beg);
-    std::string buf(sz, '\0');
-    if (!f.read(&buf[0], sz)) return "";
-    return buf;
+// --stdout-buffering: Stdio leaves print_utf8 on puts and libc's own policy
+enum class StdoutBuffering { Stdio, None, Line, Full };
+
+static bool parse_stdout_buffering(StringRef s, StdoutBuffering& out) {
+    if (s == "none") out = StdoutBuffering::None;
+    else if (s == "line") out = StdoutBuffering::Line;
+    else if (s == "full") out = StdoutBuffering::Full;
+    else return false;
+    return true;
 }
 
-static int load_mods(const std::string& dir, std::vector<ModMap>& maps) {
-    int count = 0;
-#ifdef _WIN32
-    std::string pattern = dir + "\\*.xfmod";
-    WIN32_FIND_DATAA fd;
-    HANDLE h = FindFirstFileA(pattern.c_str(), &fd);
-    if (h == INVALID_HANDLE_VALUE) return 0;
-    do {
-        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
-        std::string path = dir + "\\" + fd.cFileName;
-        DEBUG_LOG("load_mods: reading %s\n", path.c_str());
-        std::string buf = read_file_safely(path);
-        if (buf.empty()) { DEBUG_LOG("load_mods: read_file_safely returned empty for %s\n", path.c_str()); continue; }
-        DEBUG_LOG("load_mods: buf[0..80]=%.80s\n", buf.c_str());
-        const char* p = buf.c_str();
-        while (*p) {
-            while (*p && *p != '"') p++;
-            if (!*p) break;
-            const char* a = p + 1;
-            const char* q = strchr(a, '"');
-            if (!q) break;
-            size_t llen = (size_t)(q - a);
-            if (llen >= 127) llen = 127;
-            std::string lhs(a, llen);
-            p = q + 1;
-            DEBUG_LOG("load_mods: found lhs='%s'\n", lhs.c_str());
-            while (*p && *p != '=') p++;
-            if (!*p) break;
-            p++;
-            while (*p && *p != '"') p++;
-            if (!*p) break;
-            const char* b = p + 1;
-            q = strchr(b, '"');
-            if (!q) break;
-            size_t rlen = (size_t)(q - b);
-            if (rlen >= 127) rlen = 127;
-            std::string rhs(b, rlen);
-            p = q + 1;
-            DEBUG_LOG("load_mods: found rhs='%s'\n", rhs.c_str());
-            if (count < 128) {
-                ModMap m;
-                m.from = lhs;
-                m.to = rhs;
-                maps.push_back(m);
-                count++;
-            }
-        }
-    } while (FindNextFileA(h, &fd));
-    FindClose(h);
-#else
-    DIR* d = opendir(dir.c_str());
-    if (!d) return 0;
-    struct dirent* e;
-    while ((e = readdir(d)) != nullptr) {
-        std::string name = e->d_name;
-        if (name.size() <= 6 || name.substr(name.size() - 6) != ".xfmod") continue;
-        std::string path = dir + "/" + name;
-        DEBUG_LOG("load_mods: reading %s\n", path.c_str());
-        std::string buf = read_file_safely(path);
-        if (buf.empty()) { DEBUG_LOG("load_mods: read_file_safely returned empty for %s\n", path.c_str()); continue; }
-        DEBUG_LOG("load_mods: buf[0..80]=%.80s\n", buf.c_str());
-        const char* p = buf.c_str();
-        while (*p) {
-            while (*p && *p != '"') p++;
-            if (!*p) break;
-            const char* a = p + 1;
-            const char* q = strchr(a, '"');
-            if (!q) break;
-            size_t llen = (size_t)(q - a);
-            if (llen >= 127) llen = 127;
-            std::string lhs(a, llen);
-            p = q + 1;
-            while (*p && *p != '=') p++;
-            if (!*p) break;
-            p++;
-            while (*p && *p != '"') p++;
-            if (!*p) break;
-            const char* b = p + 1;
-            q = strchr(b, '"');
-            if (!q) break;
-            size_t rlen = (size_t)(q - b);
-            if (rlen >= 127) rlen = 127;
-            std::string rhs(b, rlen);
-            p = q + 1;
-            if (count < 128) {
-                ModMap m;
-                m.from = lhs;
-                m.to = rhs;
-                maps.push_back(m);
-                count++;
-            }
-        }
+#define STDOUT_BUFFER_SIZE 65536
+
+// The output runtime behind --stdout-buffering, built straight into the
+// module. print_utf8 copies into a 64 KiB buffer that goes out through
+// write() (_write on Windows) when full, after every print with =line, and
+// from xf_flush_stdout, which main calls before returning. With =none each
+// print is copied into the buffer together with its newline and written with
+// one call, so concurrent writers cannot split a line from its newline; only a
+// line that does not fit takes two writes. xf programs run on a single
+// thread, so the buffer is not locked.
+static Function* CreateBufferedPrintFunction(Module* M, IRBuilder<>* Builder, StdoutBuffering mode,
+                                             Function** FlushOut) {
+    LLVMContext& Context = M->getContext();
+    Type* I8 = Type::getInt8Ty(Context);
+    Type* I32 = Type::getInt32Ty(Context);
+    Type* I64 = Type::getInt64Ty(Context);
+    Type* I8Ptr = Type::getInt8PtrTy(Context);
+    Type* VoidTy = Type::getVoidTy(Context);
+    bool windows = Triple(M->getTargetTriple()).isOSWindows();
+    FunctionCallee WriteFunc = windows
+        ? M->getOrInsertFunction("_write", FunctionType::get(I32, {I32, I8Ptr, I32}, false))
+        : M->getOrInsertFunction("write", FunctionType::get(I64, {I32, I8Ptr, I64}, false));
+
+    // xf_write_all(p, n): write() until all n bytes are out or it fails
+    Function* WriteAll = Function::Create(FunctionType::get(VoidTy, {I8Ptr, I64}, false),
+                                          Function::InternalLinkage, "xf_write_all", M);
+    {
+        BasicBlock* Entry = BasicBlock::Create(Context, "entry", WriteAll);
+        BasicBlock* Loop = BasicBlock::Create(Context, "loop", WriteAll);
+        BasicBlock* Body = BasicBlock::Create(Context, "body", WriteAll);
+        BasicBlock* Next = BasicBlock::Create(Context, "next", WriteAll);
+        BasicBlock* Done = BasicBlock::Create(Context, "done", WriteAll);
+        Builder->SetInsertPoint(Entry);
+        Builder->CreateBr(Loop);
+        Builder->SetInsertPoint(Loop);
+        PHINode* P = Builder->CreatePHI(I8Ptr, 2);
+        PHINode* N = Builder->CreatePHI(I64, 2);
+        P->addIncoming(WriteAll->getArg(0), Entry);
+        N->addIncoming(WriteAll->getArg(1), Entry);
+        Builder->CreateCondBr(Builder->CreateICmpSGT(N, ConstantInt::get(I64, 0)), Body, Done);
+        Builder->SetInsertPoint(Body);
+        Value* Len = windows ? Builder->CreateTrunc(Builder->CreateBinaryIntrinsic(Intrinsic::umin, N,
+                                                        ConstantInt::get(I64, INT32_MAX)), I32) : N;
+        Value* R = Builder->CreateCall(WriteFunc, {ConstantInt::get(I32, 1), P, Len});
+        R = Builder->CreateSExt(R, I64);
+        Builder->CreateCondBr(Builder->CreateICmpSGT(R, ConstantInt::get(I64, 0)), Next, Done);
+        Builder->SetInsertPoint(Next);
+        P->addIncoming(Builder->CreateInBoundsGEP(I8, P, R), Next);
+        N->addIncoming(Builder->CreateSub(N, R), Next);
+        Builder->CreateBr(Loop);
+        Builder->SetInsertPoint(Done);
+        Builder->CreateRetVoid();
     }
-    closedir(d);
-#endif
-    return count;
-}
 
-static std::string apply_mods(const std::string& src, const std::vector<ModMap>& maps) {
-    if (maps.empty()) return src;
-    std::string out;
-    out.reserve(src.size() + 1024);
-    const char* p = src.c_str();
-    while (*p) {
-        if (*p == '"') {
-            const char* q = p + 1;
-            while (*q && !(*q == '"' && *(q-1) != '\\')) q++;
-            size_t len = (*q == '"') ? (q - p + 1) : (q - p);
-            out.append(p, len);
-            p += len;
-            continue;
-        }
-        if (std::isalpha((unsigned char)*p) || *p == '_') {
-            const char* s = p;
-            while (std::isalnum((unsigned char)*p) || *p == '_') p++;
-            size_t tl = p - s;
-            std::string tok(s, tl);
-            bool rep = false;
-            for (const auto& m : maps) {
-                if (tok == m.from) {
-                    out += m.to;
-                    rep = true;
-                    break;
-                }
-            }
-            if (!rep) out += tok;
-            continue;
-        }
-        out += *p++;
+    FunctionType* FT = FunctionType::get(VoidTy, {I8Ptr}, false);
+    Function* F = Function::Create(FT, Function::ExternalLinkage, "print_utf8", M);
+    Value* Arg = F->getArg(0);
+    FunctionCallee StrlenFunc = M->getOrInsertFunction("strlen", FunctionType::get(I64, {I8Ptr}, false));
+    Constant* Newline = ConstantDataArray::getString(Context, "\n", false);
+    GlobalVariable* NewlineGV = new GlobalVariable(*M, Newline->getType(), true, GlobalValue::PrivateLinkage,
+                                                   Newline, "xf.newline");
+    NewlineGV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    ArrayType* BufTy = ArrayType::get(I8, STDOUT_BUFFER_SIZE);
+    GlobalVariable* Buf = new GlobalVariable(*M, BufTy, false, GlobalValue::InternalLinkage,
+                                             ConstantAggregateZero::get(BufTy), "xf.stdout.buf");
+    Value* BufStart = ConstantExpr::getBitCast(Buf, I8Ptr);
+    if (mode == StdoutBuffering::None) {
+        *FlushOut = nullptr;
+        BasicBlock* Entry = BasicBlock::Create(Context, "entry", F);
+        BasicBlock* One = BasicBlock::Create(Context, "one", F);
+        BasicBlock* Two = BasicBlock::Create(Context, "two", F);
+        Builder->SetInsertPoint(Entry);
+        Value* Len = Builder->CreateCall(StrlenFunc, {Arg});
+        Builder->CreateCondBr(Builder->CreateICmpULT(Len, ConstantInt::get(I64, STDOUT_BUFFER_SIZE)), One, Two);
+        Builder->SetInsertPoint(One);
+        Builder->CreateMemCpy(BufStart, MaybeAlign(1), Arg, MaybeAlign(1), Len);
+        Builder->CreateStore(ConstantInt::get(I8, '\n'), Builder->CreateInBoundsGEP(I8, BufStart, Len));
+        Builder->CreateCall(WriteAll, {BufStart, Builder->CreateAdd(Len, ConstantInt::get(I64, 1))});
+        Builder->CreateRetVoid();
+        Builder->SetInsertPoint(Two);
+        Builder->CreateCall(WriteAll, {Arg, Len});
+        Builder->CreateCall(WriteAll, {Builder->CreateBitCast(NewlineGV, I8Ptr), ConstantInt::get(I64, 1)});
+        Builder->CreateRetVoid();
+        return F;
     }
-    return out;
+
+    GlobalVariable* BufLen = new GlobalVariable(*M, I64, false, GlobalValue::InternalLinkage,
+                                                ConstantInt::get(I64, 0), "xf.stdout.len");
+
+    // xf_flush_stdout(): hands the buffered bytes to the OS
+    Function* Flush = Function::Create(FunctionType::get(VoidTy, false), Function::InternalLinkage,
+                                       "xf_flush_stdout", M);
+    Builder->SetInsertPoint(BasicBlock::Create(Context, "entry", Flush));
+    Builder->CreateCall(WriteAll, {BufStart, Builder->CreateLoad(I64, BufLen)});
+    Builder->CreateStore(ConstantInt::get(I64, 0), BufLen);
+    Builder->CreateRetVoid();
+    *FlushOut = Flush;
+
+    // copy the text in pieces that fit, flushing whenever the buffer fills,
+    // then append the newline
+    BasicBlock* Entry = BasicBlock::Create(Context, "entry", F);
+    BasicBlock* Loop = BasicBlock::Create(Context, "copy", F);
+    BasicBlock* Full = BasicBlock::Create(Context, "full", F);
+    BasicBlock* Next = BasicBlock::Create(Context, "next", F);
+    BasicBlock* Tail = BasicBlock::Create(Context, "newline", F);
+    Builder->SetInsertPoint(Entry);
+    Value* Total = Builder->CreateCall(StrlenFunc, {Arg});
+    Builder->CreateBr(Loop);
+    Builder->SetInsertPoint(Loop);
+    PHINode* P = Builder->CreatePHI(I8Ptr, 2);
+    PHINode* N = Builder->CreatePHI(I64, 2);
+    P->addIncoming(Arg, Entry);
+    N->addIncoming(Total, Entry);
+    Value* Used = Builder->CreateLoad(I64, BufLen);
+    Value* Room = Builder->CreateSub(ConstantInt::get(I64, STDOUT_BUFFER_SIZE), Used);
+    Value* K = Builder->CreateBinaryIntrinsic(Intrinsic::umin, N, Room);
+    Builder->CreateMemCpy(Builder->CreateInBoundsGEP(I8, BufStart, Used), MaybeAlign(1), P, MaybeAlign(1), K);
+    Value* NewUsed = Builder->CreateAdd(Used, K);
+    Builder->CreateStore(NewUsed, BufLen);
+    Builder->CreateCondBr(Builder->CreateICmpEQ(NewUsed, ConstantInt::get(I64, STDOUT_BUFFER_SIZE)), Full, Next);
+    Builder->SetInsertPoint(Full);
+    Builder->CreateCall(Flush);
+    Builder->CreateBr(Next);
+    Builder->SetInsertPoint(Next);
+    Value* Rest = Builder->CreateSub(N, K);
+    P->addIncoming(Builder->CreateInBoundsGEP(I8, P, K), Next);
+    N->addIncoming(Rest, Next);
+    Builder->CreateCondBr(Builder->CreateICmpEQ(Rest, ConstantInt::get(I64, 0)), Tail, Loop);
+    // the copy loop never leaves the buffer full, so the newline fits
+    Builder->SetInsertPoint(Tail);
+    Used = Builder->CreateLoad(I64, BufLen);
+    Builder->CreateStore(ConstantInt::get(I8, '\n'), Builder->CreateInBoundsGEP(I8, BufStart, Used));
+    Builder->CreateStore(Builder->CreateAdd(Used, ConstantInt::get(I64, 1)), BufLen);
+    if (mode == StdoutBuffering::Line) Builder->CreateCall(Flush);
+    Builder->CreateRetVoid();
+    return F;
 }
 
-#define MAX_RANGE_ELEMENTS 4096
+// The random[...] runtime: xoshiro256** seeded through splitmix64, drawn
+// with Lemire's unbiased bounded sampling. xf_random(lo, span) returns a
+// 64-bit value in [lo, lo + span). The state seeds itself on first use, from `seed`
+// (--seed) when given, else from XF_SEED in the environment, else from the
+// clock. xf programs run on a single thread, so there is one state per
+// process. With LinkOnceODR linkage every module of a program (--lto=thin
+// units, --repl fragments) defines it and they all end up sharing one copy.
+static Function* CreateRandomFunction(Module* M, GlobalValue::LinkageTypes linkage, Optional<uint64_t> seed) {
+    LLVMContext& Context = M->getContext();
+    IRBuilder<> B(Context);
+    Type* I32 = Type::getInt32Ty(Context);
+    Type* I64 = Type::getInt64Ty(Context);
+    Type* I8Ptr = Type::getInt8PtrTy(Context);
+    ArrayType* StateTy = ArrayType::get(I64, 4);
+    GlobalVariable* State = new GlobalVariable(*M, StateTy, false, linkage, ConstantAggregateZero::get(StateTy),
+                                               "xf.rng.state");
+    auto word = [&](unsigned k) { return B.CreateConstInBoundsGEP2_64(StateTy, State, 0, k); };
+    auto rotl = [&](Value* x, unsigned k) {
+        return B.CreateIntrinsic(Intrinsic::fshl, {I64}, {x, x, ConstantInt::get(I64, k)});
+    };
+    auto shr_xor = [&](Value* z, unsigned k) { return B.CreateXor(z, B.CreateLShr(z, k)); };
+
+    // xf_rng_seed(): splitmix64 spreads the 64-bit seed over the state
+    Function* Seed = Function::Create(FunctionType::get(Type::getVoidTy(Context), false), linkage, "xf_rng_seed", M);
+    BasicBlock* SeedEntry = BasicBlock::Create(Context, "entry", Seed);
+    B.SetInsertPoint(SeedEntry);
+    Value* X;
+    if (seed) {
+        X = ConstantInt::get(I64, *seed);
+    } else {
+        FunctionCallee Getenv = M->getOrInsertFunction("getenv", FunctionType::get(I8Ptr, {I8Ptr}, false));
+        FunctionCallee Strtoull = M->getOrInsertFunction("strtoull", FunctionType::get(I64, {I8Ptr, PointerType::getUnqual(I8Ptr), I32}, false));
+        FunctionCallee Time = M->getOrInsertFunction("time", FunctionType::get(I64, {I8Ptr}, false));
+        BasicBlock* FromEnv = BasicBlock::Create(Context, "env", Seed);
+        BasicBlock* FromClock = BasicBlock::Create(Context, "clock", Seed);
+        BasicBlock* Mix = BasicBlock::Create(Context, "mix", Seed);
+        Value* Env = B.CreateCall(Getenv, {B.CreateGlobalStringPtr("XF_SEED", "xf.seed.env", 0, M)});
+        B.CreateCondBr(B.CreateIsNull(Env), FromClock, FromEnv);
+        B.SetInsertPoint(FromEnv);
+        Value* EnvSeed = B.CreateCall(Strtoull, {Env, ConstantPointerNull::get(PointerType::getUnqual(I8Ptr)),
+                                                 ConstantInt::get(I32, 0)});
+        B.CreateBr(Mix);
+        B.SetInsertPoint(FromClock);
+        Value* ClockSeed = B.CreateCall(Time, {ConstantPointerNull::get(cast<PointerType>(I8Ptr))});
+        B.CreateBr(Mix);
+        B.SetInsertPoint(Mix);
+        PHINode* P = B.CreatePHI(I64, 2);
+        P->addIncoming(EnvSeed, FromEnv);
+        P->addIncoming(ClockSeed, FromClock);
+        X = P;
+    }
+    for (unsigned k = 0; k < 4; ++k) {
+        X = B.CreateAdd(X, ConstantInt::get(I64, 0x9e3779b97f4a7c15ULL));
+        Value* Z = B.CreateMul(shr_xor(X, 30), ConstantInt::get(I64, 0xbf58476d1ce4e5b9ULL));
+        Z = B.CreateMul(shr_xor(Z, 27), ConstantInt::get(I64, 0x94d049bb133111ebULL));
+        B.CreateStore(shr_xor(Z, 31), word(k));
+    }
+    B.CreateRetVoid();
+
+    // xf_rng_next(): one xoshiro256** step; an all-zero state is unseeded
+    Function* Next = Function::Create(FunctionType::get(I64, false), linkage, "xf_rng_next", M);
+    BasicBlock* NextEntry = BasicBlock::Create(Context, "entry", Next);
+    BasicBlock* Load = BasicBlock::Create(Context, "load", Next);
+    BasicBlock* Unseeded = BasicBlock::Create(Context, "seed", Next);
+    BasicBlock* Step = BasicBlock::Create(Context, "step", Next);
+    B.SetInsertPoint(NextEntry);
+    B.CreateBr(Load);
+    B.SetInsertPoint(Load);
+    Value* S[4];
+    for (unsigned k = 0; k < 4; ++k) S[k] = B.CreateLoad(I64, word(k));
+    Value* Any = B.CreateOr(B.CreateOr(S[0], S[1]), B.CreateOr(S[2], S[3]));
+    B.CreateCondBr(B.CreateIsNull(Any), Unseeded, Step);
+    B.SetInsertPoint(Unseeded);
+    B.CreateCall(Seed);
+    B.CreateBr(Load);
+    B.SetInsertPoint(Step);
+    Value* Result = B.CreateMul(rotl(B.CreateMul(S[1], ConstantInt::get(I64, 5)), 7), ConstantInt::get(I64, 9));
+    Value* T = B.CreateShl(S[1], 17);
+    Value* S2 = B.CreateXor(S[2], S[0]);
+    Value* S3 = B.CreateXor(S[3], S[1]);
+    Value* S1 = B.CreateXor(S[1], S2);
+    Value* S0 = B.CreateXor(S[0], S3);
+    B.CreateStore(S0, word(0));
+    B.CreateStore(S1, word(1));
+    B.CreateStore(B.CreateXor(S2, T), word(2));
+    B.CreateStore(rotl(S3, 45), word(3));
+    B.CreateRet(Result);
 
-static std::string trim(const std::string& s) {
-    size_t a = 0; while (a < s.size() && isspace((unsigned char)s[a])) a++;
-    size_t b = s.size(); while (b > a && isspace((unsigned char)s[b-1])) b--;
-    return s.substr(a, b-a);
+    // xf_random(lo, span): Lemire's multiply-shift, redrawing only in the
+    // biased low part of the 128-bit product; span 0 is the whole 64-bit range
+    Type* I128 = Type::getInt128Ty(Context);
+    Function* F = Function::Create(FunctionType::get(I64, {I64, I64}, false), linkage, "xf_random", M);
+    Value* Lo = F->getArg(0);
+    Value* Span = F->getArg(1);
+    BasicBlock* Entry = BasicBlock::Create(Context, "entry", F);
+    BasicBlock* Whole = BasicBlock::Create(Context, "whole", F);
+    BasicBlock* Draw = BasicBlock::Create(Context, "draw", F);
+    BasicBlock* Check = BasicBlock::Create(Context, "check", F);
+    BasicBlock* Done = BasicBlock::Create(Context, "done", F);
+    B.SetInsertPoint(Entry);
+    B.CreateCondBr(B.CreateIsNull(Span), Whole, Draw);
+    B.SetInsertPoint(Whole);
+    B.CreateRet(B.CreateAdd(Lo, B.CreateCall(Next)));
+    B.SetInsertPoint(Draw);
+    Value* M128 = B.CreateMul(B.CreateZExt(B.CreateCall(Next), I128), B.CreateZExt(Span, I128));
+    Value* Low = B.CreateTrunc(M128, I64);
+    B.CreateCondBr(B.CreateICmpULT(Low, Span), Check, Done);
+    B.SetInsertPoint(Check);
+    Value* Threshold = B.CreateURem(B.CreateNeg(Span), Span);     // 2^64 mod span
+    B.CreateCondBr(B.CreateICmpULT(Low, Threshold), Draw, Done);
+    B.SetInsertPoint(Done);
+    B.CreateRet(B.CreateAdd(Lo, B.CreateTrunc(B.CreateLShr(M128, 64), I64)));
+    return F;
 }
 
-static std::string escape_bytes_as_c_string(const std::string& s) {
-    std::string out;
-    for (size_t i = 0; i < s.size(); ++i) {
-        unsigned char c = (unsigned char)s[i];
-        if (c == '"') out += "\\\"";
-        else if (c == '\\') out += "\\\\";
-        else if (c == '\n') out += "\\n";
-        else if (c == '\r') out += "\\r";
-        else if (c == '\t') out += "\\t";
-        else if (c >= 0x20 && c <= 0x7E) out += (char)c;
-        else {
-            char hex[5];
-            std::snprintf(hex, sizeof(hex), "\\x%02X", c);
-            out += hex;
+// ---------------------------------------------------------------------------
+// Source buffers
+// 输入文件和 mod 文件都只读映射进来（MemoryBuffer 对 16KiB 以上的文件使用 mmap，
+// 小文件、管道和 stdin 则退回 read()），之后的阶段只拿 StringRef 视图，不再复制。
+// ---------------------------------------------------------------------------
+
+class SourceBuffer {
+public:
+    // "-" reads stdin
+    bool open(const std::string& path) {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
+            MemoryBuffer::getFileOrSTDIN(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+        if (!MB) {
+            err = MB.getError().message();
+            return false;
         }
+        buf = std::move(*MB);
+        return true;
     }
-    return out;
-}
+    StringRef text() const { return buf ? buf->getBuffer() : StringRef(); }
+    bool is_mapped() const { return buf && buf->getBufferKind() == MemoryBuffer::MemoryBuffer_MMap; }
+    const std::string& error() const { return err; }
 
-static int parse_range(const std::string& s, int* out_start, int* out_end, int* out_step) {
-    size_t p = 0;
-    while (p < s.size() && isspace((unsigned char)s[p])) p++;
-    size_t dots = s.find("...", p);
-    if (dots == std::string::npos) return 0;
-    std::string left = s.substr(p, dots - p);
-    p = dots + 3;
-    size_t colon = s.find(':', p);
-    std::string right = (colon == std::string::npos) ? s.substr(p) : s.substr(p, colon - p);
-    int step = 1;
-    if (colon != std::string::npos) {
-        step = std::atoi(s.substr(colon + 1).c_str());
-        if (step <= 0) return 0;
-    }
-    int a = std::atoi(left.c_str());
-    int b = std::atoi(right.c_str());
-    if (b < a) return 0;
-    long cnt = ((long)(b - a) / step) + 1;
-    if (cnt <= 0 || cnt > MAX_RANGE_ELEMENTS) return -1;
-    *out_start = a; *out_end = b; *out_step = step;
-    return 1;
+private:
+    std::unique_ptr<MemoryBuffer> buf;
+    std::string err;
+};
+
+// a generator walks from `first` towards `last` by a non-zero `step`
+static bool check_range(long long first, long long last, long long step) {
+    return step > 0 ? first <= last : step < 0 && first >= last;
 }
 
 static std::string make_fn_name(const std::string& block, const std::string& fn) {
@@ -286,573 +509,2853 @@ static std::string make_fn_name(const std::string& block, const std::string& fn)
     return out;
 }
 
-int main(int argc, char** argv) {
-    if (argc < 2) {
-        std::fprintf(stderr, "Usage: %s <input.xf> [-o output_exe] [--mods-dir <dir>] [--debug] [--keep-temp] [--emit-ir <file>]\n", argv[0]);
-        std::fprintf(stderr, "Version: %s\n", VERSION);
-        return 1;
-    }
-    
-    const char* infile = nullptr;
-    const char* outfile = nullptr;
-    const char* modsdir = "mods";
-    const char* emit_ir_file = nullptr;
-    int self_test = 0;
-    
-    // 重置全局标志
-    g_debug = 0;
-    g_keep_temp = 0;
-    
-    for (int i = 1; i < argc; ++i) {
-        if (std::strcmp(argv[i], "-o") == 0 && i+1 < argc) {
-            outfile = argv[++i];
-        }
-        else if (std::strcmp(argv[i], "--mods-dir") == 0 && i+1 < argc) {
-            modsdir = argv[++i];
+struct SrcLoc {
+    uint32_t line;
+    uint32_t col;
+};
+
+// set by batch workers so each diagnostic names its input
+static thread_local const char* g_diag_file = nullptr;
+
+static void vdiag(const char* level, SrcLoc loc, const char* fmt, va_list ap) {
+    // formatted first and written with one call, so lines from parallel
+    // compiles do not interleave
+    va_list aq;
+    va_copy(aq, ap);
+    int n = std::vsnprintf(nullptr, 0, fmt, aq);
+    va_end(aq);
+    std::string msg(n > 0 ? (size_t)n : 0, '\0');
+    if (n > 0) std::vsnprintf(&msg[0], msg.size() + 1, fmt, ap);
+    if (g_diag_file) std::fprintf(stderr, "%s: %s: line %u, col %u: %s\n", level, g_diag_file, loc.line, loc.col, msg.c_str());
+    else std::fprintf(stderr, "%s: line %u, col %u: %s\n", level, loc.line, loc.col, msg.c_str());
+}
+
+static void diag(const char* level, SrcLoc loc, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vdiag(level, loc, fmt, ap);
+    va_end(ap);
+}
+
+// ---------------------------------------------------------------------------
+// Stage 1: structural index
+// 先用 SIMD 一次性找出 { } " # $ @ \n 和 // 的位置（字符串和注释里的除外），
+// 词法分析据此直接跳过字符串和注释，而不是逐字节扫描。
+// Each 64-byte chunk is classified into bitmasks (AVX2, SSE2 or scalar),
+// then only the quote/comment/newline bits are walked to find the string
+// and comment regions, so the serial part costs O(events), not O(bytes).
+// ---------------------------------------------------------------------------
+
+struct StructuralIndex {
+    // offsets of structural characters outside strings and comments, in order:
+    // { } # $ @, every newline, both quotes of a string literal and the
+    // first '/' of each // comment
+    std::vector<uint32_t> offsets;
+};
+
+struct ChunkMasks {
+    uint64_t quote;
+    uint64_t slash;
+    uint64_t newline;
+    uint64_t structural;     // { } # $ @
+};
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define XF_HAVE_SSE2 1
+static uint64_t eq_mask_sse2(const __m128i v[4], char c) {
+    __m128i k = _mm_set1_epi8(c);
+    uint64_t r0 = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[0], k));
+    uint64_t r1 = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[1], k));
+    uint64_t r2 = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[2], k));
+    uint64_t r3 = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[3], k));
+    return r0 | (r1 << 16) | (r2 << 32) | (r3 << 48);
+}
+
+static void classify_chunk_sse2(const char* p, ChunkMasks& m) {
+    __m128i v[4];
+    for (int i = 0; i < 4; ++i) v[i] = _mm_loadu_si128((const __m128i*)(p + 16 * i));
+    m.quote = eq_mask_sse2(v, '"');
+    m.slash = eq_mask_sse2(v, '/');
+    m.newline = eq_mask_sse2(v, '\n');
+    m.structural = eq_mask_sse2(v, '{') | eq_mask_sse2(v, '}') | eq_mask_sse2(v, '#') |
+                   eq_mask_sse2(v, '$') | eq_mask_sse2(v, '@');
+}
+#endif
+
+#ifndef XF_HAVE_SSE2
+// fallback for targets without SSE2, where AVX2 may still be missing at run time
+static void classify_chunk_scalar(const char* p, ChunkMasks& m) {
+    m = ChunkMasks{0, 0, 0, 0};
+    for (int i = 0; i < 64; ++i) {
+        uint64_t bit = 1ULL << i;
+        switch (p[i]) {
+        case '"': m.quote |= bit; break;
+        case '/': m.slash |= bit; break;
+        case '\n': m.newline |= bit; break;
+        case '{': case '}': case '#': case '$': case '@': m.structural |= bit; break;
+        default: break;
         }
-        else if (std::strcmp(argv[i], "--debug") == 0) {
-            g_debug = 1;
-            DEBUG_LOG("Debug mode enabled\n");
+    }
+}
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define XF_HAVE_AVX2 1
+__attribute__((target("avx2")))
+static uint64_t eq_mask_avx2(__m256i lo, __m256i hi, char c) {
+    __m256i k = _mm256_set1_epi8(c);
+    uint64_t r0 = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, k));
+    uint64_t r1 = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, k));
+    return r0 | (r1 << 32);
+}
+
+__attribute__((target("avx2")))
+static void classify_chunk_avx2(const char* p, ChunkMasks& m) {
+    __m256i lo = _mm256_loadu_si256((const __m256i*)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i*)(p + 32));
+    m.quote = eq_mask_avx2(lo, hi, '"');
+    m.slash = eq_mask_avx2(lo, hi, '/');
+    m.newline = eq_mask_avx2(lo, hi, '\n');
+    m.structural = eq_mask_avx2(lo, hi, '{') | eq_mask_avx2(lo, hi, '}') | eq_mask_avx2(lo, hi, '#') |
+                   eq_mask_avx2(lo, hi, '$') | eq_mask_avx2(lo, hi, '@');
+}
+#endif
+
+typedef void (*ClassifyFn)(const char*, ChunkMasks&);
+
+static ClassifyFn pick_classifier() {
+#ifdef XF_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) return classify_chunk_avx2;
+#endif
+#ifdef XF_HAVE_SSE2
+    return classify_chunk_sse2;
+#else
+    return classify_chunk_scalar;
+#endif
+}
+
+// bits [a, b) of a 64-bit word
+static uint64_t bit_range(unsigned a, unsigned b) {
+    if (a >= 64) return 0;
+    uint64_t hi = b >= 64 ? ~0ULL : ((1ULL << b) - 1);
+    return hi & ~((1ULL << a) - 1);
+}
+
+static bool quote_is_escaped(const char* base, size_t pos) {
+    size_t n = 0;
+    while (pos > n && base[pos - n - 1] == '\\') n++;
+    return (n & 1) != 0;
+}
+
+static void build_structural_index(StringRef src, StructuralIndex& idx) {
+    static const ClassifyFn classify = pick_classifier();
+    enum { Normal, InString, InComment } state = Normal;
+    const char* base = src.data();
+    size_t len = src.size();
+    idx.offsets.clear();
+    idx.offsets.reserve(len / 8 + 16);
+    char tail[64];
+    for (size_t off = 0; off < len; off += 64) {
+        const char* chunk = base + off;
+        size_t n = len - off;
+        if (n < 64) {
+            std::memset(tail, 0, sizeof(tail));
+            std::memcpy(tail, chunk, n);
+            chunk = tail;
         }
-        else if (std::strcmp(argv[i], "--keep-temp") == 0) {
-            g_keep_temp = 1;
-            DEBUG_LOG("Keeping temporary files\n");
+        ChunkMasks m;
+        classify(chunk, m);
+        // "//" starts where a slash is followed by another one, possibly in the next chunk
+        uint64_t next_slash = (n > 64 && base[off + 64] == '/') ? (1ULL << 63) : 0;
+        uint64_t comment_start = m.slash & ((m.slash >> 1) | next_slash);
+        uint64_t events = m.quote | comment_start | m.newline;
+        uint64_t masked = 0;     // interior of strings and comments
+        uint64_t kept = 0;       // quote/comment/newline bits that stay structural
+        unsigned region = 0;     // first bit of the region that is currently open
+        while (events) {
+            unsigned b = (unsigned)countTrailingZeros(events);
+            uint64_t bit = 1ULL << b;
+            events &= events - 1;
+            if (state == Normal) {
+                kept |= bit;
+                if (m.quote & bit) { state = InString; region = b + 1; }
+                else if (comment_start & bit) { state = InComment; region = b + 1; }
+            } else if (state == InString) {
+                // a string also ends at the newline when the closing quote is missing
+                if ((m.newline & bit) || ((m.quote & bit) && !quote_is_escaped(base, off + b))) {
+                    masked |= bit_range(region, b);
+                    kept |= bit;
+                    state = Normal;
+                }
+            } else if (m.newline & bit) {
+                masked |= bit_range(region, b);
+                kept |= bit;
+                state = Normal;
+            }
         }
-        else if (std::strcmp(argv[i], "--emit-ir") == 0 && i+1 < argc) {
-            emit_ir_file = argv[++i];
-            DEBUG_LOG("Will emit IR to: %s\n", emit_ir_file);
+        if (state != Normal) masked |= bit_range(region, 64);
+        uint64_t out = (m.structural & ~masked) | kept;
+        if (n < 64) out &= bit_range(0, (unsigned)n);
+        while (out) {
+            idx.offsets.push_back((uint32_t)(off + countTrailingZeros(out)));
+            out &= out - 1;
         }
-        else if (std::strcmp(argv[i], "--self-test") == 0) {
-            self_test = 1;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Lexer
+// 单遍扫描整个源文件，输出带字节偏移和行/列位置的 token 流。
+// 注释在这里被丢弃，字符串字面量只扫描一次，后面的阶段都只看 token。
+// ---------------------------------------------------------------------------
+
+enum class Tok : uint8_t {
+    Eof, Newline, Ident, Number, String,
+    Hash, Dollar, At, LBrace, RBrace, LParen, RParen, LBracket, RBracket,
+    Assign, EqEq, NotEq, Lt, Le, Gt, Ge,
+    Plus, Minus, Star, Slash, Percent, Colon, Ellipsis, Unknown
+};
+
+struct Token {
+    Tok kind;
+    SrcLoc loc;
+    size_t offset;           // byte offset of the first character in the source
+    StringRef text;          // String: contents between the quotes, escapes not decoded
+    uint32_t match;          // LBrace: index of the matching RBrace (or of Eof)
+};
+
+static bool is_ident_start(char c) { return std::isalpha((unsigned char)c) || c == '_'; }
+static bool is_ident_char(char c) { return std::isalnum((unsigned char)c) || c == '_'; }
+
+static int lex_source(StringRef src, const StructuralIndex& idx, std::vector<Token>& toks) {
+    const char* base = src.begin();
+    const char* p = base;
+    const char* end = src.end();
+    const char* line_start = base;
+    uint32_t line = 1;
+    int errors = 0;
+    size_t k = 0;                    // cursor into idx.offsets, only moves forward
+    toks.reserve(toks.size() + src.size() / 4 + 1);
+
+    auto push = [&](Tok kind, const char* s, const char* e) {
+        Token t;
+        t.kind = kind;
+        t.loc = SrcLoc{line, (uint32_t)(s - line_start) + 1};
+        t.offset = (size_t)(s - base);
+        t.text = StringRef(s, e - s);
+        t.match = 0;
+        toks.push_back(t);
+    };
+    // the structural character after `off`; for an opening quote that is the
+    // closing quote (or the newline), for a comment it is the ending newline
+    auto structural_after = [&](size_t off) -> const char* {
+        while (k < idx.offsets.size() && idx.offsets[k] <= off) k++;
+        return k < idx.offsets.size() ? base + idx.offsets[k] : end;
+    };
+
+    while (p < end) {
+        const char* s = p;
+        char c = *p;
+        switch (c) {
+        case ' ': case '\t': case '\r': case '\f': case '\v':
+            p++;
+            continue;
+        case '\n':
+            // a run of blank lines collapses into one Newline token
+            if (toks.empty() || toks.back().kind != Tok::Newline) push(Tok::Newline, s, s + 1);
+            p++;
+            line++;
+            line_start = p;
+            continue;
+        case '"': {
+            const char* q = structural_after((size_t)(p - base));
+            if (q >= end || *q != '"') {
+                diag("Error", SrcLoc{line, (uint32_t)(s - line_start) + 1}, "unterminated string literal");
+                errors++;
+                push(Tok::Unknown, s, q);
+                p = q;
+                continue;
+            }
+            p = q + 1;
+            push(Tok::String, s, p);
+            toks.back().text = StringRef(s + 1, q - s - 1);
+            continue;
         }
-        else if (argv[i][0] == '-') {
-            // 忽略未知选项，避免崩溃
-            DEBUG_LOG("Unknown option: %s\n", argv[i]);
+        case '/':
+            if (p + 1 < end && p[1] == '/') {
+                p = structural_after((size_t)(p - base));
+                continue;
+            }
+            push(Tok::Slash, s, ++p);
+            continue;
+        case '#': push(Tok::Hash, s, ++p); continue;
+        case '$': push(Tok::Dollar, s, ++p); continue;
+        case '@': push(Tok::At, s, ++p); continue;
+        case '{': push(Tok::LBrace, s, ++p); continue;
+        case '}': push(Tok::RBrace, s, ++p); continue;
+        case '(': push(Tok::LParen, s, ++p); continue;
+        case ')': push(Tok::RParen, s, ++p); continue;
+        case '[': push(Tok::LBracket, s, ++p); continue;
+        case ']': push(Tok::RBracket, s, ++p); continue;
+        case '+': push(Tok::Plus, s, ++p); continue;
+        case '-': push(Tok::Minus, s, ++p); continue;
+        case '*': push(Tok::Star, s, ++p); continue;
+        case '%': push(Tok::Percent, s, ++p); continue;
+        case ':': push(Tok::Colon, s, ++p); continue;
+        case '=':
+            if (p + 1 < end && p[1] == '=') { p += 2; push(Tok::EqEq, s, p); }
+            else push(Tok::Assign, s, ++p);
+            continue;
+        case '!':
+            if (p + 1 < end && p[1] == '=') { p += 2; push(Tok::NotEq, s, p); }
+            else push(Tok::Unknown, s, ++p);
+            continue;
+        case '<':
+            if (p + 1 < end && p[1] == '=') { p += 2; push(Tok::Le, s, p); }
+            else push(Tok::Lt, s, ++p);
+            continue;
+        case '>':
+            if (p + 1 < end && p[1] == '=') { p += 2; push(Tok::Ge, s, p); }
+            else push(Tok::Gt, s, ++p);
+            continue;
+        case '.':
+            if (end - p >= 3 && p[1] == '.' && p[2] == '.') { p += 3; push(Tok::Ellipsis, s, p); }
+            else push(Tok::Unknown, s, ++p);
+            continue;
+        default:
+            break;
         }
-        else if (!infile) {
-            infile = argv[i];
+        if (is_ident_start(c)) {
+            while (p < end && is_ident_char(*p)) p++;
+            push(Tok::Ident, s, p);
+        } else if (std::isdigit((unsigned char)c)) {
+            while (p < end && std::isdigit((unsigned char)*p)) p++;
+            push(Tok::Number, s, p);
+        } else if ((unsigned char)c >= 0x80) {
+            // non-ASCII text outside a string, e.g. “ ” quotes; keep the whole run
+            while (p < end && (unsigned char)*p >= 0x80) p++;
+            push(Tok::Unknown, s, p);
+        } else {
+            push(Tok::Unknown, s, ++p);
         }
     }
-    
-    // 自测试模式
-    if (self_test) {
-        DEBUG_LOG("Running self-test...\n");
-        std::fprintf(stderr, "Self-test not implemented yet\n");
-        return 0;
+    push(Tok::Eof, end, end);
+    return errors;
+}
+
+// fills in Token::match; an unclosed '{' matches the final Eof
+static void match_braces(std::vector<Token>& toks) {
+    std::vector<uint32_t> open_braces;
+    for (uint32_t k = 0; k < toks.size(); ++k) {
+        if (toks[k].kind == Tok::LBrace) {
+            open_braces.push_back(k);
+        } else if (toks[k].kind == Tok::RBrace && !open_braces.empty()) {
+            toks[open_braces.back()].match = k;
+            open_braces.pop_back();
+        }
     }
-    
-    if (!infile) {
-        std::fprintf(stderr, "Error: No input file specified\n");
-        return 1;
+    for (uint32_t o : open_braces) toks[o].match = (uint32_t)toks.size() - 1;
+}
+
+// ---------------------------------------------------------------------------
+// Mods
+// mods 目录下所有 .xfmod 文件里的 "a" = "b" 规则。a 和 b 都是 token 序列（可以是多个
+// 单词或标点），所有规则编译成一个 Aho-Corasick 自动机，在词法分析之后一遍扫描改写 token 流。
+// 编译结果缓存在 mods 目录旁边的 <dir>.xfmodc 里，目录和文件都没变时直接映射使用。
+// ---------------------------------------------------------------------------
+
+// Symbols the automaton runs on. Punctuation is its Tok value + 1; identifiers,
+// numbers, strings and non-ASCII runs are interned by (kind, text) starting at
+// MOD_FIRST_TEXT_SYM. Text that no rule mentions maps to MOD_NO_SYM, which has
+// no edges and sends the automaton back to the root.
+static const uint32_t MOD_NO_SYM = 0;
+static const uint32_t MOD_FIRST_TEXT_SYM = 64;
+
+static bool mod_sym_has_text(Tok k) {
+    return k == Tok::Ident || k == Tok::Number || k == Tok::String || k == Tok::Unknown;
+}
+
+// both hashes are stored in .xfmodc packs and must stay stable
+static uint32_t mod_sym_hash(Tok kind, StringRef text) {
+    return djbHash(text, 5381 + (uint32_t)kind);
+}
+
+static uint32_t mod_edge_hash(uint32_t state, uint32_t sym) {
+    uint64_t k = ((uint64_t)state << 32 | sym) * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(k >> 32);
+}
+
+// .xfmodc layout, all integers little-endian, offsets from the start of the file:
+//   ModPackHeader
+//   ModPackFile[nfiles]     what the pack was built from, see ModDirState
+//   ModSymSlot[nsyms]       symbol interning table (open addressing, linear probing)
+//   ModEdgeSlot[nedges]     automaton goto edges keyed by (state, symbol), same scheme
+//   ModStateRec[nstates]    state 0 is the root
+//   ModRuleRec[nrules]
+//   string data             file names, symbol texts and replacement texts
+// nsyms and nedges are powers of two; empty slots have id / to equal to 0.
+// A compiled rule set that was not loaded from disk uses the same layout in memory.
+static const char MOD_PACK_MAGIC[8] = {'X', 'F', 'M', 'O', 'D', 'C', 0, 2};
+
+struct ModPackHeader {
+    char magic[8];
+    support::ulittle64_t dir_mtime;
+    support::ulittle32_t nfiles, nsyms, nedges, nstates, nrules;
+    support::ulittle32_t files_off, syms_off, edges_off, states_off, rules_off, strings_off;
+};
+
+struct ModPackFile {
+    support::ulittle32_t name_off, name_len;
+    support::ulittle64_t mtime, size;
+};
+
+struct ModSymSlot {
+    support::ulittle32_t hash, kind, text_off, text_len, id;
+};
+
+struct ModEdgeSlot {
+    support::ulittle32_t from, sym, to;
+};
+
+struct ModStateRec {
+    support::ulittle32_t fail;
+    support::ulittle32_t depth;
+    support::ulittle32_t rule;      // 1 + the longest rule ending in this state, or 0
+};
+
+struct ModRuleRec {
+    support::ulittle32_t ntoks;     // length of the pattern
+    support::ulittle32_t to_off, to_len;
+};
+
+// A compiled rule set: views into `image`, which is either a mapped .xfmodc or
+// a buffer built from the .xfmod sources. Replacements are lexed when the
+// image is attached, so the table is read-only afterwards and threads can
+// share it.
+struct ModTable {
+    std::unique_ptr<MemoryBuffer> image;
+    const char* base = nullptr;
+    ArrayRef<ModSymSlot> syms;
+    ArrayRef<ModEdgeSlot> edges;
+    ArrayRef<ModStateRec> states;
+    ArrayRef<ModRuleRec> rules;
+    std::vector<std::vector<Token>> lexed;      // replacement tokens of each rule
+
+    bool attach(std::unique_ptr<MemoryBuffer> buf);
+    size_t size() const { return rules.size(); }
+
+    uint32_t symbol(const Token& t) const {
+        if (!mod_sym_has_text(t.kind)) return t.kind == Tok::Newline || t.kind == Tok::Eof ? MOD_NO_SYM : (uint32_t)t.kind + 1;
+        if (syms.empty()) return MOD_NO_SYM;
+        uint32_t h = mod_sym_hash(t.kind, t.text);
+        uint32_t mask = (uint32_t)syms.size() - 1;
+        for (uint32_t k = h & mask;; k = (k + 1) & mask) {
+            const ModSymSlot& s = syms[k];
+            if (s.id == MOD_NO_SYM) return MOD_NO_SYM;
+            if (s.hash == h && s.kind == (uint32_t)t.kind && StringRef(base + s.text_off, s.text_len) == t.text) return s.id;
+        }
     }
-    
-    DEBUG_LOG("Input: '%s', Output: '%s', Mods dir: '%s'\n", 
-              infile, outfile ? outfile : "(default)", modsdir ? modsdir : "(null)");
-    std::ifstream ifs(infile, std::ios::binary);
-        if (!ifs) { std::fprintf(stderr, "Error: Cannot open input file %s\n", infile); return 2; }
-    std::ostringstream ss; ss << ifs.rdbuf(); std::string code = ss.str();
-        DEBUG_LOG("read input file, size=%zu\n", code.size());
-        
-        std::vector<ModMap> maps;
-        if (modsdir) {
-            int mcount = load_mods(modsdir, maps);
-            DEBUG_LOG("load_mods returned %d\n", mcount);
-            if (mcount > 0) {
-                code = apply_mods(code, maps);
-                DEBUG_LOG("mods applied, code len=%zu\n", code.size());
-            }
-        }
-    std::string functions;
-    std::string entry_fn;
-    bool need_time = false;
-    
-    const char* scan = code.c_str();
-    while (1) {
-        const char* ob = strchr(scan, '#');
-        if (!ob) break;
-        const char* name_start = ob + 1;
-        while (*name_start && isspace((unsigned char)*name_start)) name_start++;
-        const char* name_end = name_start;
-        while (*name_end && (isalnum((unsigned char)*name_end) || *name_end == '_')) name_end++;
-        if (name_start == name_end) { scan = ob + 1; continue; }
-        std::string blockname(name_start, name_end - name_start);
-        const char* oblock = strchr(name_end, '{');
-        if (!oblock) { scan = name_end; continue; }
-        const char* p = oblock + 1;
-        int lvl = 1;
-        const char* start = p;
-        while (*p && lvl > 0) {
-            if (*p == '{') lvl++;
-            else if (*p == '}') lvl--;
-            p++;
+
+    uint32_t edge(uint32_t state, uint32_t sym) const {
+        uint32_t mask = (uint32_t)edges.size() - 1;
+        for (uint32_t k = mod_edge_hash(state, sym) & mask;; k = (k + 1) & mask) {
+            const ModEdgeSlot& e = edges[k];
+            if (e.to == 0) return 0;
+            if (e.from == state && e.sym == sym) return e.to;
+        }
     }
-        if (lvl != 0) break;
-        const char* end = p - 1;
-        
-        const char* line = start;
-        while (line < end) {
-            const char* le = line;
-            while (le < end && *le != '\n') le++;
-            const char* s = line;
-            while (s < le && isspace((unsigned char)*s)) s++;
-            const char* e = le;
-            while (e > s && isspace((unsigned char)e[-1])) e--;
-            
-            // remove // comments
-            const char* comment = strstr(s, "//");
-            if (comment && comment < e) {
-                e = comment;
-            }
-            
-            size_t llen = e - s;
-            if (llen > 0) {
-                if (llen >= 3 && strncmp(s, "fn", 2) == 0 && isspace((unsigned char)s[2])) {
-                    DEBUG_LOG("found fn line: '%.80s'\n", s);
-                    const char* fnstart = s + 2;
-                    while (fnstart < e && isspace((unsigned char)*fnstart)) fnstart++;
-                    const char* fnend = fnstart;
-                    while (fnend < e && (isalnum((unsigned char)*fnend) || *fnend == '_')) fnend++;
-                    std::string fnname(fnstart, fnend - fnstart);
-                    const char* brace = strchr(s, '{');
-                    if (!brace) { line = le + 1; continue; }
-                    const char* q = brace + 1;
-                    int l = 1;
-                    const char* bodystart = q;
-                    while (q < end && l > 0) {
-                        if (*q == '{') l++;
-                        else if (*q == '}') l--;
-                        q++;
-                    }
-                    const char* bodyend = q - 1;
-                    std::string fname = make_fn_name(blockname, fnname);
-                    if (entry_fn.empty()) entry_fn = fname;
-                    if (fnname == "call" || fnname == "main" || fnname == "Test" || fnname == "you_function_name") {
-                        entry_fn = fname;
-                    }
-                    functions += "void " + fname + "(void) {\n";
-                    const char* L = bodystart;
-                    while (L < bodyend) {
-                        const char* NL = L;
-                        while (NL < bodyend && *NL != '\n') NL++;
-                        const char* ss = L;
-                        while (ss < NL && isspace((unsigned char)*ss)) ss++;
-                        const char* ee = NL;
-                        while (ee > ss && isspace((unsigned char)ee[-1])) ee--;
-                        
-                        // remove // comments
-                        const char* comment = strstr(ss, "//");
-                        if (comment && comment < ee) {
-                            ee = comment;
-                        }
-                        
-                        size_t lon = ee - ss;
-                        if (lon > 0) {
-                            if (ss[0] == '$') {
-                                const char* at = (const char*)memchr(ss, '@', lon);
-                                if (at) {
-                                    size_t bnl = at - (ss + 1);
-                                    std::string bname(ss + 1, bnl);
-                                    size_t fnl2 = ee - at - 1;
-                                    std::string f2(at + 1, fnl2);
-                                    std::string calln = make_fn_name(bname, f2);
-                                    functions += "    " + calln + "();\n";
-                                }
-                            } else if (lon >= 6 && strncmp(ss, "print(", 6) == 0) {
-                                const char* qs = strchr(ss, '"');
-                                if (qs) {
-                                    const char* qe = qs + 1;
-                                    while (*qe && *qe != '"') {
-                                        if (*qe == '\\' && *(qe+1)) qe += 2;
-                                        else qe++;
-                                    }
-                                    if (*qe == '"') {
-                                        size_t ql = qe - qs - 1;
-                                        std::string lit(qs + 1, ql);
-                                        std::string esc = escape_bytes_as_c_string(lit);
-                                        functions += "    print_utf8(\"" + esc + "\");\n";
-                                    }
-                                }
-                            } else if (lon > 2 && memchr(ss, '=', lon)) {
-                                const char* eq = (const char*)memchr(ss, '=', lon);
-                                const char* idend = eq;
-                                while (idend > ss && isspace((unsigned char)idend[-1])) idend--;
-                                const char* idstart = idend;
-                                while (idstart > ss && (isalnum((unsigned char)idstart[-1]) || idstart[-1] == '_')) idstart--;
-                                size_t idl = idend - idstart;
-                                std::string ident(idstart, idl);
-                                const char* valstart = eq + 1;
-                                while (valstart < ee && isspace((unsigned char)*valstart)) valstart++;
-                                const char* valend = ee;
-                                while (valend > valstart && isspace((unsigned char)valend[-1])) valend--;
-                                std::string val(valstart, valend - valstart);
-                                if (val.find("random[") == 0 || val.find("rnd[") == 0) {
-                                    size_t br = val.find('[');
-                                    if (br != std::string::npos) {
-                                        size_t rb = val.find(']', br);
-                                        if (rb != std::string::npos) {
-                                            std::string inner = val.substr(br + 1, rb - br - 1);
-                                            int a, b, step;
-                                            int pr = parse_range(inner, &a, &b, &step);
-                                            if (pr == -1) {
-                                                std::fprintf(stderr, "Error: Range too large for %s.%s (max %d elements)\n", blockname.c_str(), ident.c_str(), MAX_RANGE_ELEMENTS);
-                                                L = NL + 1;
-                                                continue;
-                                            }
-                                            need_time = true;
-                                            char buf[512];
-                                            std::snprintf(buf, sizeof(buf), "    int %s = (rand() %% (%d - %d + 1)) + %d;\n", ident.c_str(), b, a, a);
-                                            functions += buf;
-                                        }
-                                    }
-                                } else if (val.find("sequential[") == 0 || val.find("seq[") == 0 || val.find("reciprocal[") == 0 || val.find("rcp[") == 0) {
-                                    size_t br = val.find('[');
-                                    if (br != std::string::npos) {
-                                        size_t rb = val.find(']', br);
-                                        if (rb != std::string::npos) {
-                                            std::string inner = val.substr(br + 1, rb - br - 1);
-                                            int a, b, step;
-                                            int pr = parse_range(inner, &a, &b, &step);
-                                            if (pr == -1) {
-                                                std::fprintf(stderr, "Error: Range too large for %s.%s (max %d elements)\n", blockname.c_str(), ident.c_str(), MAX_RANGE_ELEMENTS);
-                                                L = NL + 1;
-                                                continue;
-                                            }
-                                            if (pr == 0) {
-                                                std::fprintf(stderr, "Error: Invalid range syntax for %s.%s\n", blockname.c_str(), ident.c_str());
-                                                L = NL + 1;
-                                                continue;
-                                            }
-                                            char idxname[128];
-                                            std::snprintf(idxname, sizeof(idxname), "__seq_%s_idx", ident.c_str());
-                                            char buf[512];
-                                            if (val.find("reciprocal") == 0 || val.find("rcp") == 0) {
-                                                std::snprintf(buf, sizeof(buf), "    static int %s = 0; int %s = %d - (%s++ * %d); if (%s < %d) %s = 0;\n", idxname, ident.c_str(), b, idxname, step, ident.c_str(), a, idxname);
-                                            } else {
-                                                std::snprintf(buf, sizeof(buf), "    static int %s = 0; int %s = %d + (%s++ * %d); if (%s > %d) %s = 0;\n", idxname, ident.c_str(), a, idxname, step, ident.c_str(), b, idxname);
-                                            }
-                                            functions += buf;
-                                        }
-                                    }
-                                } else {
-                                    char buf[512];
-                                    std::snprintf(buf, sizeof(buf), "    int %s = %s;\n", ident.c_str(), val.c_str());
-                                    functions += buf;
-                                }
-                            } else if (lon >= 2 && strncmp(ss, "if", 2) == 0 && isspace((unsigned char)ss[2])) {
-                                const char* bpos = (const char*)memchr(ss, '{', lon);
-                                if (bpos) {
-                                    const char* conds = ss + 2;
-                                    while (conds < (ss + lon) && isspace((unsigned char)*conds)) conds++;
-                                    const char* cend = bpos;
-                                    while (cend > conds && isspace((unsigned char)cend[-1])) cend--;
-                                    std::string cond(conds, cend - conds);
-                                    char buf[512];
-                                    std::snprintf(buf, sizeof(buf), "    if (%s) {\n", cond.c_str());
-                                    functions += buf;
-                                    const char* ibody = bpos + 1;
-                                    int ilvl = 1;
-                                    const char* iq = ibody;
-                                    while (iq < bodyend && ilvl > 0) {
-                                        if (*iq == '{') ilvl++;
-                                        else if (*iq == '}') ilvl--;
-                                        iq++;
-                                    }
-                                    const char* iend = iq - 1;
-                                    const char* iL = ibody;
-                                    while (iL < iend) {
-                                        const char* iNL = iL;
-                                        while (iNL < iend && *iNL != '\n') iNL++;
-                                        if (iNL > iL) {
-                                            std::string iline(iL, iNL - iL);
-                                            std::string itrimmed = trim(iline);
-                                            if (!itrimmed.empty() && itrimmed != "}") {
-                                                functions += "        " + iline + "\n";
-                                            }
-                                        }
-                                        iL = iNL + 1;
-                                    }
-                                    functions += "    }\n";
-                                    L = iend;
-                                    continue;
-                                }
-                            } else if (lon >= 7 && strncmp(ss, "else if", 7) == 0) {
-                                const char* conds = ss + 7;
-                                while (conds < ee && isspace((unsigned char)*conds)) conds++;
-                                const char* bpos = (const char*)memchr(conds, '{', ee - conds);
-                                if (bpos) {
-                                    const char* cend = bpos;
-                                    while (cend > conds && isspace((unsigned char)cend[-1])) cend--;
-                                    std::string cond(conds, cend - conds);
-                                    char buf[512];
-                                    std::snprintf(buf, sizeof(buf), "    else if (%s) {\n", cond.c_str());
-                                    functions += buf;
-                                    const char* ibody = bpos + 1;
-                                    int ilvl = 1;
-                                    const char* iq = ibody;
-                                    while (iq < bodyend && ilvl > 0) {
-                                        if (*iq == '{') ilvl++;
-                                        else if (*iq == '}') ilvl--;
-                                        iq++;
-                                    }
-                                    const char* iend = iq - 1;
-                                    const char* iL = ibody;
-                                    while (iL < iend) {
-                                        const char* iNL = iL;
-                                        while (iNL < iend && *iNL != '\n') iNL++;
-                                        if (iNL > iL) {
-                                            std::string iline(iL, iNL - iL);
-                                            std::string itrimmed = trim(iline);
-                                            if (!itrimmed.empty() && itrimmed != "}") {
-                                                functions += "        " + iline + "\n";
-                                            }
-                                        }
-                                        iL = iNL + 1;
-                                    }
-                                    functions += "    }\n";
-                                    L = iend;
-                                    continue;
-                                }
-                            } else if (lon >= 4 && strncmp(ss, "else", 4) == 0) {
-                                const char* bpos = (const char*)memchr(ss, '{', lon);
-                                if (bpos) {
-                                    functions += "    else {\n";
-                                    const char* ibody = bpos + 1;
-                                    int ilvl = 1;
-                                    const char* iq = ibody;
-                                    while (iq < bodyend && ilvl > 0) {
-                                        if (*iq == '{') ilvl++;
-                                        else if (*iq == '}') ilvl--;
-                                        iq++;
-                                    }
-                                    const char* iend = iq - 1;
-                                    const char* iL = ibody;
-                                    while (iL < iend) {
-                                        const char* iNL = iL;
-                                        while (iNL < iend && *iNL != '\n') iNL++;
-                                        if (iNL > iL) {
-                                            std::string iline(iL, iNL - iL);
-                                            std::string itrimmed = trim(iline);
-                                            if (!itrimmed.empty() && itrimmed != "}") {
-                                                functions += "        " + iline + "\n";
-    }
-                                        }
-                                        iL = iNL + 1;
-                                    }
-                                    functions += "    }\n";
-                                    L = iend;
-                                    continue;
-                                }
-                            } else if (ss[0] == '}') {
-                                functions += "\n";
-                            }
-                        }
-                        L = NL + 1;
-                    }
-                    functions += "}\n";
-                    line = bodyend + 1;
-                    continue;
-                }
-            }
-            line = le + 1;
+
+    // Aho-Corasick transition: follow failure links until an edge matches
+    uint32_t step(uint32_t state, uint32_t sym) const {
+        if (sym == MOD_NO_SYM) return 0;
+        while (true) {
+            if (uint32_t to = edge(state, sym)) return to;
+            if (state == 0) return 0;
+            state = states[state].fail;
         }
-        scan = end + 1;
     }
-    
-    if (functions.empty() && entry_fn.empty()) {
-        std::fprintf(stderr, "Error: No functions found in code\n");
-        return 5;
+
+    const std::vector<Token>& replacement(uint32_t rule) const { return lexed[rule]; }
+};
+
+// lexes the text of a rule; false if it does not form valid tokens
+static bool lex_mod_text(StringRef text, std::vector<Token>& toks) {
+    StructuralIndex idx;
+    build_structural_index(text, idx);
+    if (lex_source(text, idx, toks) > 0) return false;
+    toks.pop_back();  // Eof
+    return true;
+}
+
+// checks the structure of a compiled rule set and points the views at it
+bool ModTable::attach(std::unique_ptr<MemoryBuffer> buf) {
+    StringRef data = buf->getBuffer();
+    if (data.size() < sizeof(ModPackHeader)) return false;
+    const ModPackHeader* hdr = reinterpret_cast<const ModPackHeader*>(data.data());
+    if (std::memcmp(hdr->magic, MOD_PACK_MAGIC, sizeof(hdr->magic)) != 0) return false;
+    // a pack from this version that fails a check below is damaged
+    auto bad = [&] {
+        std::fprintf(stderr, "Warning: %s is not a valid mod pack, rebuilding it\n", buf->getBufferIdentifier().str().c_str());
+        return false;
+    };
+    uint64_t off = sizeof(ModPackHeader);
+    auto section = [&](uint32_t at, uint32_t n, size_t elt) {
+        if (at != off) return false;
+        off += (uint64_t)n * elt;
+        return off <= data.size();
+    };
+    if (!section(hdr->files_off, hdr->nfiles, sizeof(ModPackFile)) ||
+        !section(hdr->syms_off, hdr->nsyms, sizeof(ModSymSlot)) ||
+        !section(hdr->edges_off, hdr->nedges, sizeof(ModEdgeSlot)) ||
+        !section(hdr->states_off, hdr->nstates, sizeof(ModStateRec)) ||
+        !section(hdr->rules_off, hdr->nrules, sizeof(ModRuleRec)) ||
+        hdr->strings_off != off ||
+        !isPowerOf2_32(hdr->nsyms) || !isPowerOf2_32(hdr->nedges) || hdr->nstates == 0)
+        return bad();
+    auto in_strings = [&](uint64_t at, uint64_t len) { return at >= off && at + len <= data.size(); };
+    const char* p = data.data();
+    ArrayRef<ModPackFile> fs(reinterpret_cast<const ModPackFile*>(p + hdr->files_off), hdr->nfiles);
+    ArrayRef<ModSymSlot> ss(reinterpret_cast<const ModSymSlot*>(p + hdr->syms_off), hdr->nsyms);
+    ArrayRef<ModEdgeSlot> es(reinterpret_cast<const ModEdgeSlot*>(p + hdr->edges_off), hdr->nedges);
+    ArrayRef<ModStateRec> sts(reinterpret_cast<const ModStateRec*>(p + hdr->states_off), hdr->nstates);
+    ArrayRef<ModRuleRec> rs(reinterpret_cast<const ModRuleRec*>(p + hdr->rules_off), hdr->nrules);
+    for (const ModPackFile& f : fs)
+        if (!in_strings(f.name_off, f.name_len)) return bad();
+    for (const ModSymSlot& s : ss)
+        if (s.id != MOD_NO_SYM && !in_strings(s.text_off, s.text_len)) return bad();
+    for (const ModEdgeSlot& e : es)
+        if (e.to != 0 && (e.to >= sts.size() || e.from >= sts.size())) return bad();
+    for (const ModStateRec& st : sts)
+        if (st.fail >= sts.size() || st.rule > rs.size()) return bad();
+    for (const ModRuleRec& r : rs)
+        if (r.ntoks == 0 || !in_strings(r.to_off, r.to_len)) return bad();
+    for (const ModStateRec& st : sts)
+        if (st.rule != 0 && rs[st.rule - 1].ntoks > st.depth) return bad();
+    // step() follows fail links until it reaches the root, so each one must
+    // lead to a shallower state; hash probes stop at the first empty slot,
+    // so both tables need one
+    if (sts[0].depth != 0) return bad();
+    for (size_t k = 1; k < sts.size(); ++k)
+        if (sts[sts[k].fail].depth >= sts[k].depth) return bad();
+    if (std::none_of(ss.begin(), ss.end(), [](const ModSymSlot& s) { return s.id == MOD_NO_SYM; }) ||
+        std::none_of(es.begin(), es.end(), [](const ModEdgeSlot& e) { return e.to == 0; }))
+        return bad();
+    std::vector<std::vector<Token>> toks(rs.size());
+    for (size_t i = 0; i < rs.size(); ++i)
+        if (!lex_mod_text(StringRef(p + rs[i].to_off, rs[i].to_len), toks[i])) return bad();
+
+    image = std::move(buf);
+    base = p;
+    syms = ss;
+    edges = es;
+    states = sts;
+    rules = rs;
+    lexed = std::move(toks);
+    return true;
+}
+
+// What a pack was built from: the directory's mtime (changes when a file is
+// added, removed or replaced) and the mtime and size of every .xfmod in it.
+struct ModFileState {
+    std::string name;
+    uint64_t mtime;
+    uint64_t size;
+};
+
+struct ModDirState {
+    uint64_t mtime = 0;
+    std::vector<ModFileState> files;
+};
+
+// Collects rules from .xfmod sources and compiles them into the image layout.
+struct ModRuleBuilder {
+    struct Node {
+        DenseMap<uint32_t, uint32_t> next;
+        uint32_t fail = 0, depth = 0, rule = 0;
+    };
+    struct Rule {
+        uint32_t ntoks;
+        std::string to;
+    };
+    StringMap<uint32_t> sym_ids;            // kind byte + text -> symbol
+    std::vector<std::pair<Tok, std::string>> sym_texts;
+    std::vector<Node> nodes = std::vector<Node>(1);
+    std::vector<Rule> rules;
+    ModDirState state;
+
+    uint32_t intern(const Token& t) {
+        if (!mod_sym_has_text(t.kind)) return (uint32_t)t.kind + 1;
+        std::string key(1, (char)t.kind);
+        key += t.text;
+        auto ins = sym_ids.try_emplace(key, MOD_FIRST_TEXT_SYM + (uint32_t)sym_texts.size());
+        if (ins.second) sym_texts.emplace_back(t.kind, t.text.str());
+        return ins.first->second;
     }
-    DEBUG_LOG("parsed functions, entry_fn='%s'\n", entry_fn.c_str());
-    
-    InitializeLLVMTargets();
-    
-    LLVMContext Context;
-    std::unique_ptr<Module> M = std::make_unique<Module>("xfawa_module", Context);
-    IRBuilder<> Builder(Context);
-    
-    // Create print_utf8 function declaration
-    Function* PrintUTF8Func = CreatePrintUTF8Function(M.get(), &Builder);
-    
-    // Create function type for our user functions (void return, no arguments)
-    FunctionType* VoidFuncType = FunctionType::get(Type::getVoidTy(Context), false);
-    
-    // Create a map to keep track of created functions
-    std::map<std::string, Function*> created_functions;
-    
-    // Parse and create functions using LLVM IR
-    std::istringstream func_stream(functions);
-    std::string line;
-    std::string current_func_name;
-    Function* current_func = nullptr;
-    BasicBlock* current_bb = nullptr;
-    
-    while (std::getline(func_stream, line)) {
-        // Check for function definition start
-        if (line.find("void ") == 0 && line.find("() {") != std::string::npos) {
-            size_t start = 5; // Skip "void "
-            size_t end = line.find("() {");
-            current_func_name = line.substr(start, end - start);
-            
-            // Create new function
-            current_func = Function::Create(VoidFuncType, Function::InternalLinkage, current_func_name, M.get());
-            created_functions[current_func_name] = current_func;
-            current_bb = BasicBlock::Create(Context, "entry", current_func);
-            Builder.SetInsertPoint(current_bb);
-            
-            DEBUG_LOG("Created function: %s\n", current_func_name.c_str());
-        }
-        // Check for function end
-        else if (line == "}") {
-            if (current_func) {
-                // Add return instruction
-                Builder.CreateRetVoid();
-                current_func = nullptr;
-                current_bb = nullptr;
-            }
-        }
-        // Handle print statements
-        else if (line.find("print_utf8(") != std::string::npos) {
-            if (current_func && line.find('"') != std::string::npos) {
-                size_t start = line.find('"') + 1;
-                size_t end = line.rfind('"');
-                if (start < end) {
-                    std::string str = line.substr(start, end - start);
-                    // Create global string constant
-                    Constant* StrConstant = ConstantDataArray::getString(Context, str);
-                    GlobalVariable* GV = new GlobalVariable(*M, StrConstant->getType(), true, 
-                                                          GlobalValue::PrivateLinkage, StrConstant);
-                    // Create GEP to get pointer to the first character
-                    Value* Zero = Constant::getNullValue(Type::getInt64Ty(Context));
-                    Value* indices[] = { Zero, Zero };
-                    Value* StrPtr = Builder.CreateGEP(GV->getType()->getPointerElementType(), GV, indices);
-                    // Call print_utf8 function
-                    Builder.CreateCall(PrintUTF8Func, {StrPtr});
-                }
-            }
+
+    void add(StringRef from, StringRef to, const std::string& path) {
+        std::vector<Token> pat, rep;
+        if (!lex_mod_text(from, pat) || pat.empty() ||
+            llvm::any_of(pat, [](const Token& t) { return t.kind == Tok::Newline; })) {
+            std::fprintf(stderr, "Warning: %s: mod pattern \"%.*s\" is not a token sequence on one line, ignored\n",
+                         path.c_str(), (int)from.size(), from.data());
+            return;
         }
-        // Handle variable declarations
-        else if (line.find("int ") != std::string::npos && line.find(" = ") != std::string::npos) {
-            if (current_func) {
-                size_t int_start = line.find("int ") + 4;
-                size_t eq_pos = line.find(" = ");
-                std::string var_name = line.substr(int_start, eq_pos - int_start);
-                var_name = trim(var_name);
-                
-                size_t val_start = eq_pos + 3;
-                size_t val_end = line.find(';');
-                std::string val_str = line.substr(val_start, val_end - val_start);
-                val_str = trim(val_str);
-                
-                // Try to parse as integer constant
-                try {
-                    int val = std::stoi(val_str);
-                    Value* IntVal = ConstantInt::get(Type::getInt32Ty(Context), val);
-                    Value* Alloca = Builder.CreateAlloca(Type::getInt32Ty(Context), nullptr, var_name);
-                    Builder.CreateStore(IntVal, Alloca);
-                } catch (...) {
-                    // For non-constant values, we'll just create an alloca for now
-                    // TODO: Implement expression evaluation
-                    Builder.CreateAlloca(Type::getInt32Ty(Context), nullptr, var_name);
-                }
-            }
+        if (!lex_mod_text(to, rep)) {
+            std::fprintf(stderr, "Warning: %s: replacement for mod pattern \"%.*s\" does not lex, ignored\n",
+                         path.c_str(), (int)from.size(), from.data());
+            return;
         }
-        // Handle if statements
-        else if (line.find("if (") == 0 && line.find(") {") != std::string::npos) {
-            if (current_func) {
-                // Extract condition
-                size_t cond_start = line.find('(') + 1;
-                size_t cond_end = line.rfind(')');
-                std::string condition = line.substr(cond_start, cond_end - cond_start);
-                
-                // Create basic blocks for if statement
-                BasicBlock* IfBlock = BasicBlock::Create(Context, "if.then", current_func);
-                BasicBlock* ElseBlock = BasicBlock::Create(Context, "if.else", current_func);
-                BasicBlock* MergeBlock = BasicBlock::Create(Context, "if.merge", current_func);
-                
-                // Create condition (for simplicity, we'll just use a placeholder true condition)
-                // TODO: Implement proper condition evaluation
-                Value* CondVal = ConstantInt::get(Type::getInt1Ty(Context), 1);
-                
-                // Create branch instruction
-                Builder.CreateCondBr(CondVal, IfBlock, ElseBlock);
-                
-                // Set insert point to if block
-                Builder.SetInsertPoint(IfBlock);
-                
-                // TODO: Parse and generate code for the if body
-                // For now, we'll just add a placeholder and unconditional branch
-                Builder.CreateBr(MergeBlock);
-                
-                // Set insert point to else block
-                Builder.SetInsertPoint(ElseBlock);
-                Builder.CreateBr(MergeBlock);
-                
-                // Set insert point to merge block
-                Builder.SetInsertPoint(MergeBlock);
-            }
-        }
-        // Handle else if statements
-        else if (line.find("else if (") == 0 && line.find(") {") != std::string::npos) {
-            if (current_func) {
-                // Extract condition
-                size_t cond_start = line.find('(') + 1;
-                size_t cond_end = line.rfind(')');
-                std::string condition = line.substr(cond_start, cond_end - cond_start);
-                
-                // Create new else-if block
-                BasicBlock* ElseIfBlock = BasicBlock::Create(Context, "elseif.then", current_func);
-                BasicBlock* ElseBlock = BasicBlock::Create(Context, "elseif.else", current_func);
-                BasicBlock* MergeBlock = BasicBlock::Create(Context, "elseif.merge", current_func);
-                
-                // Create condition (placeholder true)
-                Value* CondVal = ConstantInt::get(Type::getInt1Ty(Context), 1);
-                
-                // Create branch instruction
-                Builder.CreateCondBr(CondVal, ElseIfBlock, ElseBlock);
-                
-                // Set insert point to else-if block
-                Builder.SetInsertPoint(ElseIfBlock);
-                Builder.CreateBr(MergeBlock);
-                
-                // Set insert point to else block
-                Builder.SetInsertPoint(ElseBlock);
-                Builder.CreateBr(MergeBlock);
-                
-                // Set insert point to merge block
-                Builder.SetInsertPoint(MergeBlock);
-            }
-        }
-        // Handle else statements
-        else if (line.find("else {") == 0) {
-            if (current_func) {
-                // Create else block
-                BasicBlock* ElseBlock = BasicBlock::Create(Context, "pure.else", current_func);
-                BasicBlock* MergeBlock = BasicBlock::Create(Context, "pure.merge", current_func);
-                
-                // Set insert point to else block
-                Builder.SetInsertPoint(ElseBlock);
-                Builder.CreateBr(MergeBlock);
-                
-                // Set insert point to merge block
-                Builder.SetInsertPoint(MergeBlock);
-            }
+        uint32_t n = 0;
+        for (const Token& t : pat) {
+            uint32_t sym = intern(t);
+            auto it = nodes[n].next.find(sym);
+            if (it != nodes[n].next.end()) {
+                n = it->second;
+                continue;
             }
+            uint32_t child = (uint32_t)nodes.size();
+            nodes[n].next[sym] = child;
+            nodes.emplace_back();
+            nodes[child].depth = nodes[n].depth + 1;
+            n = child;
+        }
+        // the first definition of a pattern wins
+        if (nodes[n].rule) {
+            DEBUG_LOG("load_mods: duplicate pattern '%.*s' ignored\n", (int)from.size(), from.data());
+            return;
         }
+        rules.push_back(Rule{(uint32_t)pat.size(), to.str()});
+        nodes[n].rule = (uint32_t)rules.size();
     }
+
+    // failure links in BFS order; a state's rule falls back to the longest
+    // rule that is a suffix of it, so matching needs no output-link walk
+    void link() {
+        std::vector<uint32_t> queue;
+        for (auto& e : nodes[0].next) queue.push_back(e.second);
+        for (size_t q = 0; q < queue.size(); ++q) {
+            uint32_t s = queue[q];
+            if (!nodes[s].rule) nodes[s].rule = nodes[nodes[s].fail].rule;
+            for (auto& e : nodes[s].next) {
+                uint32_t f = nodes[s].fail;
+                while (f && !nodes[f].next.count(e.first)) f = nodes[f].fail;
+                auto it = nodes[f].next.find(e.first);
+                nodes[e.second].fail = it != nodes[f].next.end() && it->second != e.second ? it->second : 0;
+                queue.push_back(e.second);
+            }
+        }
+    }
+
+    std::string build() {
+        link();
+        std::string strings;
+        auto add_string = [&](StringRef s, support::ulittle32_t& off, support::ulittle32_t& len) {
+            off = (uint32_t)strings.size();
+            len = (uint32_t)s.size();
+            strings += s;
+        };
+        size_t nedge_count = 0;
+        for (const Node& n : nodes) nedge_count += n.next.size();
+        uint32_t nsyms = std::max<uint32_t>(8, (uint32_t)NextPowerOf2(sym_texts.size() * 2));
+        uint32_t nedges = std::max<uint32_t>(8, (uint32_t)NextPowerOf2(nedge_count * 2));
+
+        std::vector<ModPackFile> files(state.files.size());
+        for (size_t k = 0; k < files.size(); ++k) {
+            add_string(state.files[k].name, files[k].name_off, files[k].name_len);
+            files[k].mtime = state.files[k].mtime;
+            files[k].size = state.files[k].size;
+        }
+        std::vector<ModSymSlot> syms(nsyms);
+        for (size_t k = 0; k < sym_texts.size(); ++k) {
+            uint32_t h = mod_sym_hash(sym_texts[k].first, sym_texts[k].second);
+            uint32_t at = h & (nsyms - 1);
+            while (syms[at].id != MOD_NO_SYM) at = (at + 1) & (nsyms - 1);
+            syms[at].hash = h;
+            syms[at].kind = (uint32_t)sym_texts[k].first;
+            syms[at].id = MOD_FIRST_TEXT_SYM + (uint32_t)k;
+            add_string(sym_texts[k].second, syms[at].text_off, syms[at].text_len);
+        }
+        std::vector<ModEdgeSlot> edges(nedges);
+        std::vector<ModStateRec> states(nodes.size());
+        for (uint32_t s = 0; s < nodes.size(); ++s) {
+            states[s].fail = nodes[s].fail;
+            states[s].depth = nodes[s].depth;
+            states[s].rule = nodes[s].rule;
+            for (auto& e : nodes[s].next) {
+                uint32_t at = mod_edge_hash(s, e.first) & (nedges - 1);
+                while (edges[at].to != 0) at = (at + 1) & (nedges - 1);
+                edges[at].from = s;
+                edges[at].sym = e.first;
+                edges[at].to = e.second;
+            }
+        }
+        std::vector<ModRuleRec> recs(rules.size());
+        for (size_t k = 0; k < rules.size(); ++k) {
+            recs[k].ntoks = rules[k].ntoks;
+            add_string(rules[k].to, recs[k].to_off, recs[k].to_len);
+        }
+
+        ModPackHeader hdr;
+        std::memcpy(hdr.magic, MOD_PACK_MAGIC, sizeof(hdr.magic));
+        hdr.dir_mtime = state.mtime;
+        hdr.nfiles = (uint32_t)files.size();
+        hdr.nsyms = nsyms;
+        hdr.nedges = nedges;
+        hdr.nstates = (uint32_t)states.size();
+        hdr.nrules = (uint32_t)recs.size();
+        uint32_t off = sizeof(ModPackHeader);
+        hdr.files_off = off;   off += (uint32_t)(files.size() * sizeof(ModPackFile));
+        hdr.syms_off = off;    off += (uint32_t)(syms.size() * sizeof(ModSymSlot));
+        hdr.edges_off = off;   off += (uint32_t)(edges.size() * sizeof(ModEdgeSlot));
+        hdr.states_off = off;  off += (uint32_t)(states.size() * sizeof(ModStateRec));
+        hdr.rules_off = off;   off += (uint32_t)(recs.size() * sizeof(ModRuleRec));
+        hdr.strings_off = off;
+        for (ModPackFile& f : files) f.name_off = f.name_off + off;
+        for (ModSymSlot& s : syms)
+            if (s.id != MOD_NO_SYM) s.text_off = s.text_off + off;
+        for (ModRuleRec& r : recs) r.to_off = r.to_off + off;
+
+        std::string image;
+        image.reserve(off + strings.size());
+        image.append((const char*)&hdr, sizeof(hdr));
+        image.append((const char*)files.data(), files.size() * sizeof(ModPackFile));
+        image.append((const char*)syms.data(), syms.size() * sizeof(ModSymSlot));
+        image.append((const char*)edges.data(), edges.size() * sizeof(ModEdgeSlot));
+        image.append((const char*)states.data(), states.size() * sizeof(ModStateRec));
+        image.append((const char*)recs.data(), recs.size() * sizeof(ModRuleRec));
+        image += strings;
+        return image;
+    }
+};
+
+// extracts the "a" = "b" pairs of one .xfmod file
+static void parse_mod_pairs(StringRef buf, ModRuleBuilder& mods, const std::string& path) {
+    const char* p = buf.begin();
+    const char* end = buf.end();
+    auto find = [&](const char* from, char c) {
+        const char* q = (const char*)std::memchr(from, c, end - from);
+        return q ? q : end;
+    };
+    while (p < end) {
+        p = find(p, '"');
+        if (p == end) break;
+        const char* a = p + 1;
+        const char* q = find(a, '"');
+        if (q == end) break;
+        StringRef lhs(a, q - a);
+        DEBUG_LOG("load_mods: found lhs='%.*s'\n", (int)lhs.size(), lhs.data());
+        p = find(q + 1, '=');
+        if (p == end) break;
+        p = find(p + 1, '"');
+        if (p == end) break;
+        const char* b = p + 1;
+        q = find(b, '"');
+        if (q == end) break;
+        StringRef rhs(b, q - b);
+        DEBUG_LOG("load_mods: found rhs='%.*s'\n", (int)rhs.size(), rhs.data());
+        p = q + 1;
+        mods.add(lhs, rhs, path);
+    }
+}
+
+static bool stat_mod_path(const std::string& path, uint64_t& mtime, uint64_t& size) {
+    sys::fs::file_status st;
+    if (sys::fs::status(path, st)) return false;
+    mtime = (uint64_t)st.getLastModificationTime().time_since_epoch().count();
+    size = st.getSize();
+    return true;
+}
+
+static void load_mod_file(const std::string& dir, const std::string& name, ModRuleBuilder& mods) {
+    std::string path = dir + "/" + name;
+    DEBUG_LOG("load_mods: reading %s\n", path.c_str());
+    // stat before reading: if the file changes in between, the pack is stale
+    // on the next run and gets rebuilt
+    ModFileState fs{name, 0, 0};
+    if (stat_mod_path(path, fs.mtime, fs.size)) mods.state.files.push_back(fs);
+    SourceBuffer buf;
+    if (!buf.open(path) || buf.text().empty()) {
+        DEBUG_LOG("load_mods: cannot read %s\n", path.c_str());
+        return;
+    }
+    parse_mod_pairs(buf.text(), mods, path);
+}
+
+static int load_mods(const std::string& dir, ModRuleBuilder& mods) {
+    uint64_t size;
+    if (!stat_mod_path(dir, mods.state.mtime, size)) return 0;
+#ifdef _WIN32
+    std::string pattern = dir + "\\*.xfmod";
+    WIN32_FIND_DATAA fd;
+    HANDLE h = FindFirstFileA(pattern.c_str(), &fd);
+    if (h == INVALID_HANDLE_VALUE) return 0;
+    do {
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+        load_mod_file(dir, fd.cFileName, mods);
+    } while (FindNextFileA(h, &fd));
+    FindClose(h);
+#else
+    DIR* d = opendir(dir.c_str());
+    if (!d) return 0;
+    struct dirent* e;
+    while ((e = readdir(d)) != nullptr) {
+        std::string name = e->d_name;
+        if (name.size() <= 6 || name.substr(name.size() - 6) != ".xfmod") continue;
+        load_mod_file(dir, name, mods);
+    }
+    closedir(d);
+#endif
+    return (int)mods.rules.size();
+}
+
+static std::string mod_pack_path(const std::string& dir) {
+    SmallString<256> p(dir);
+    sys::fs::make_absolute(p);
+    sys::path::remove_dots(p, /*remove_dot_dot=*/true);
+    if (sys::path::filename(p).empty() || !sys::path::has_parent_path(p)) return std::string();
+    return std::string(p.str()) + ".xfmodc";
+}
+
+static bool write_file_atomically(const std::string& path, StringRef image) {
+    // write to a unique temporary and rename it over the target, so concurrent
+    // compilers never see a half-written file
+    int fd;
+    SmallString<256> tmp;
+    if (sys::fs::createUniqueFile(path + "-%%%%%%%%", fd, tmp)) return false;
+    {
+        raw_fd_ostream os(fd, /*shouldClose=*/true);
+        os << image;
+        os.close();
+        if (os.has_error()) {
+            os.clear_error();
+            sys::fs::remove(tmp);
+            return false;
+        }
+    }
+    if (sys::fs::rename(tmp, path)) {
+        sys::fs::remove(tmp);
+        return false;
+    }
+    return true;
+}
+
+// checks that the directory still matches the state recorded in the pack
+static bool mod_pack_is_current(const ModTable& mods, const std::string& dir) {
+    if (!mods.base) return false;
+    const ModPackHeader* hdr = reinterpret_cast<const ModPackHeader*>(mods.base);
+    uint64_t mtime, size;
+    if (!stat_mod_path(dir, mtime, size) || mtime != hdr->dir_mtime) return false;
+    const ModPackFile* files = reinterpret_cast<const ModPackFile*>(mods.base + hdr->files_off);
+    for (uint32_t k = 0; k < hdr->nfiles; ++k) {
+        std::string path = dir + "/" + std::string(mods.base + files[k].name_off, files[k].name_len);
+        if (!stat_mod_path(path, mtime, size) || mtime != files[k].mtime || size != files[k].size) return false;
+    }
+    return true;
+}
+
+// Loads the rules of `dir`, from its pack when that is current and from the
+// .xfmod sources otherwise. A rebuilt pack is written back (best effort);
+// `force` always rebuilds and returns false if the pack could not be written.
+static bool load_mod_dir(const std::string& dir, ModTable& mods, bool force) {
+    if (!sys::fs::is_directory(dir)) return !force;
+    std::string pack_path = mod_pack_path(dir);
+    if (!pack_path.empty() && !force) {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
+            MemoryBuffer::getFile(pack_path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+        if (MB && mods.attach(std::move(*MB)) && mod_pack_is_current(mods, dir)) {
+            DEBUG_LOG("load_mods: using %s (%zu rules)\n", pack_path.c_str(), mods.size());
+            return true;
+        }
+        DEBUG_LOG("load_mods: %s is missing or stale\n", pack_path.c_str());
+    }
+    ModRuleBuilder builder;
+    load_mods(dir, builder);
+    std::string image = builder.build();
+    if (!mods.attach(MemoryBuffer::getMemBufferCopy(image, pack_path)))
+        return false;
+    if (pack_path.empty()) return !force;
+    if (!write_file_atomically(pack_path, image)) {
+        DEBUG_LOG("load_mods: cannot write %s\n", pack_path.c_str());
+        return !force;
+    }
+    DEBUG_LOG("load_mods: wrote %s (%zu rules from %zu files)\n", pack_path.c_str(), mods.size(), builder.state.files.size());
+    return true;
+}
+
+// Rewrites the token stream with the mod rules in a single pass of the
+// automaton. Matches are leftmost-longest and do not overlap; replacement
+// tokens are not rewritten again. A match is committed as soon as no match
+// that starts at or before it can still be found, and scanning resumes right
+// after it, so tokens are revisited at most once per match.
+static void rewrite_tokens(const ModTable& mods, const std::vector<Token>& in, std::vector<Token>& out) {
+    out.reserve(in.size());
+    auto emit = [&](const Token& t) {
+        if (t.kind == Tok::Newline && !out.empty() && out.back().kind == Tok::Newline) return;
+        out.push_back(t);
+    };
+    size_t emitted = 0;                 // in[0, emitted) has been written out
+    size_t i = 0;
+    uint32_t state = 0;
+    size_t best_start = 0, best_end = 0;
+    uint32_t best_rule = 0;
+    while (i < in.size()) {
+        state = mods.step(state, mods.symbol(in[i]));
+        i++;
+        if (uint32_t r = mods.states[state].rule) {
+            size_t start = i - mods.rules[r - 1].ntoks;
+            if (!best_rule || start < best_start || (start == best_start && i > best_end)) {
+                best_start = start;
+                best_end = i;
+                best_rule = r;
+            }
+        }
+        // any later match starts at or after i - depth
+        if (best_rule && best_start < i - mods.states[state].depth) {
+            for (; emitted < best_start; ++emitted) emit(in[emitted]);
+            for (const Token& r : mods.replacement(best_rule - 1)) {
+                Token t = r;
+                t.loc = in[best_start].loc;
+                t.offset = in[best_start].offset;
+                emit(t);
+            }
+            emitted = i = best_end;
+            state = 0;
+            best_rule = 0;
+        }
+    }
+    for (; emitted < in.size(); ++emitted) emit(in[emitted]);
+}
+
+// ---------------------------------------------------------------------------
+// AST
+// 所有节点都分配在 BumpPtrAllocator 上，只持有 StringRef 和指针，不需要析构。
+// ---------------------------------------------------------------------------
+
+enum class ExprKind { Int, Var, Neg, Binary, Generator };
+enum class BinOp { Add, Sub, Mul, Div, Mod, Eq, Ne, Lt, Le, Gt, Ge };
+enum class GenKind { Random, Sequential, Reciprocal };
+
+struct Expr {
+    ExprKind kind;
+    SrcLoc loc;
+    long long ival;          // Int
+    StringRef name;          // Var
+    BinOp op;                // Binary
+    Expr* lhs;               // Binary, Neg
+    Expr* rhs;               // Binary
+    GenKind gen;             // Generator
+    long long first, last;   // Generator: rnd draws from [first, last], seq/rcp
+    long long step;          //   count from first towards last and start over
+};
+
+enum class StmtKind { Print, Call, Assign, If, For };
+
+struct Stmt {
+    StmtKind kind;
+    SrcLoc loc;
+    StringRef text;          // Print: literal with escapes already decoded
+    StringRef block, fn;     // Call: $block@fn
+    StringRef name;          // Assign; For: the loop variable
+    Expr* value;             // Assign; For: the seq/rcp generator walked
+    Expr* cond;              // If
+    Stmt* then_body;         // If; For: the loop body
+    Stmt* else_body;         // If; `else if` is a nested If here
+    Stmt* next;
+};
+
+struct FnDecl {
+    StringRef block;
+    StringRef name;
+    SrcLoc loc;
+    Stmt* body;
+    FnDecl* next;
+};
+
+struct Program {
+    FnDecl* fns = nullptr;
+    FnDecl* entry = nullptr;
+    int errors = 0;
+};
+
+template <typename T> static T* ast_new(BumpPtrAllocator& A) {
+    return new (A.Allocate<T>()) T();
+}
+
+static bool is_compare(BinOp op) {
+    return op == BinOp::Eq || op == BinOp::Ne || op == BinOp::Lt ||
+           op == BinOp::Le || op == BinOp::Gt || op == BinOp::Ge;
+}
+
+// `x == C` or `C == x`: returns the variable and sets `c`, else null
+static const Expr* match_var_eq_const(const Expr* e, long long& c) {
+    if (e->kind != ExprKind::Binary || e->op != BinOp::Eq) return nullptr;
+    const Expr* v = e->lhs->kind == ExprKind::Var ? e->lhs : e->rhs;
+    const Expr* k = v == e->lhs ? e->rhs : e->lhs;
+    if (v->kind != ExprKind::Var || k->kind != ExprKind::Int) return nullptr;
+    c = k->ival;
+    return v;
+}
+
+static bool is_entry_name(StringRef n) {
+    return n == "call" || n == "main" || n == "Test" || n == "you_function_name";
+}
+
+// ---------------------------------------------------------------------------
+// Parser: recursive descent over the token stream, builds the AST directly.
+// Every token is looked at once; statements end at a Newline token and
+// unknown lines are skipped with a warning (the old backend dropped them
+// silently).
+// ---------------------------------------------------------------------------
+
+struct Parser {
+    const std::vector<Token>& toks;
+    size_t i = 0;
+    BumpPtrAllocator& A;
+    Program& prog;
+    FnDecl** fn_tail;
+
+    Parser(const std::vector<Token>& t, BumpPtrAllocator& a, Program& pr)
+        : toks(t), A(a), prog(pr), fn_tail(&pr.fns) {}
+
+    const Token& cur() const { return toks[i]; }
+    bool is(Tok k) const { return toks[i].kind == k; }
+    bool is_word(const char* w) const { return toks[i].kind == Tok::Ident && toks[i].text == w; }
+    void next() { if (toks[i].kind != Tok::Eof) i++; }
+    bool at_eol() const { return is(Tok::Newline) || is(Tok::Eof); }
+
+    bool accept(Tok k) {
+        if (!is(k)) return false;
+        next();
+        return true;
+    }
+
+    bool accept_word(const char* w) {
+        if (!is_word(w)) return false;
+        next();
+        return true;
+    }
+
+    void skip_newlines() { while (is(Tok::Newline)) next(); }
+
+    void error(SrcLoc loc, const char* fmt, ...) {
+        va_list ap;
+        va_start(ap, fmt);
+        vdiag("Error", loc, fmt, ap);
+        va_end(ap);
+        prog.errors++;
+    }
+
+    // Skip the rest of a statement, jumping over any braced region it opens.
+    // Stops at the Newline, or before a '}' that closes the enclosing body.
+    void skip_line() {
+        while (!at_eol() && !is(Tok::RBrace)) {
+            if (is(Tok::LBrace)) {
+                i = cur().match;
+                if (is(Tok::Eof)) break;
+            }
+            next();
+        }
+    }
+
+    // ends a simple statement: only a newline or the closing '}' may follow
+    void finish_line() {
+        if (!at_eol() && !is(Tok::RBrace)) {
+            diag("Warning", cur().loc, "ignoring trailing text after statement");
+            skip_line();
+        }
+    }
+
+    StringRef decode_string(StringRef raw) {
+        if (raw.find('\\') == StringRef::npos) return raw;
+        char* out = A.Allocate<char>(raw.size());
+        size_t n = 0;
+        for (size_t k = 0; k < raw.size(); ++k) {
+            char c = raw[k];
+            if (c != '\\' || k + 1 == raw.size()) { out[n++] = c; continue; }
+            char e = raw[++k];
+            if (e == 'n') out[n++] = '\n';
+            else if (e == 't') out[n++] = '\t';
+            else if (e == 'r') out[n++] = '\r';
+            else if (e == '"' || e == '\\') out[n++] = e;
+            else { out[n++] = '\\'; out[n++] = e; }
+        }
+        return StringRef(out, n);
+    }
+
+    void parse_program() {
+        while (true) {
+            skip_newlines();
+            if (is(Tok::Eof)) break;
+            if (!accept(Tok::Hash)) {
+                if (!accept(Tok::RBrace)) skip_line();
+                continue;
+            }
+            if (!is(Tok::Ident)) continue;
+            StringRef name = cur().text;
+            next();
+            // anything between the name and '{' is ignored, e.g. "#if_test-2 {"
+            while (!is(Tok::Eof) && !is(Tok::LBrace) && !is(Tok::Hash)) next();
+            if (!accept(Tok::LBrace)) continue;
+            parse_block(name);
+        }
+    }
+
+    void parse_block(StringRef blockname) {
+        SrcLoc loc = cur().loc;
+        while (true) {
+            skip_newlines();
+            if (is(Tok::Eof)) { error(loc, "unterminated block #%.*s", (int)blockname.size(), blockname.data()); return; }
+            if (accept(Tok::RBrace)) return;
+            if (accept_word("fn")) { parse_fn(blockname); continue; }
+            // block-level statements outside of a fn are not compiled
+            DEBUG_LOG("skipping block-level statement in #%.*s at line %u\n", (int)blockname.size(), blockname.data(), cur().loc.line);
+            skip_line();
+        }
+    }
+
+    void parse_fn(StringRef blockname) {
+        SrcLoc loc = cur().loc;
+        if (!is(Tok::Ident)) { error(loc, "expected function name after 'fn'"); skip_line(); return; }
+        StringRef name = cur().text;
+        next();
+        // the parameter list is not used yet
+        while (!at_eol() && !is(Tok::LBrace)) next();
+        if (!accept(Tok::LBrace)) { error(loc, "expected '{' after fn %.*s", (int)name.size(), name.data()); skip_line(); return; }
+        FnDecl* f = ast_new<FnDecl>(A);
+        f->block = blockname;
+        f->name = name;
+        f->loc = loc;
+        f->body = parse_body(loc);
+        *fn_tail = f;
+        fn_tail = &f->next;
+        if (!prog.entry || is_entry_name(name)) prog.entry = f;
+        DEBUG_LOG("parsed fn %.*s in #%.*s\n", (int)name.size(), name.data(), (int)blockname.size(), blockname.data());
+    }
+
+    // parses statements up to and including the closing '}'
+    Stmt* parse_body(SrcLoc open) {
+        Stmt* head = nullptr;
+        Stmt** tail = &head;
+        while (true) {
+            skip_newlines();
+            if (is(Tok::Eof)) { error(open, "missing '}' for the body opened here"); break; }
+            if (accept(Tok::RBrace)) break;
+            Stmt* s = parse_stmt();
+            if (s) { *tail = s; tail = &s->next; }
+        }
+        return head;
+    }
+
+    Stmt* parse_stmt() {
+        size_t save = i;
+        Stmt* s = ast_new<Stmt>(A);
+        s->loc = cur().loc;
+        if (accept(Tok::Dollar)) {
+            if (is(Tok::Ident)) {
+                StringRef b = cur().text;
+                next();
+                if (accept(Tok::At) && is(Tok::Ident)) {
+                    s->kind = StmtKind::Call;
+                    s->block = b;
+                    s->fn = cur().text;
+                    next();
+                    finish_line();
+                    return s;
+                }
+            }
+        } else if (accept_word("print")) {
+            if (accept(Tok::LParen) && is(Tok::String)) {
+                StringRef raw = cur().text;
+                next();
+                if (accept(Tok::RParen)) {
+                    s->kind = StmtKind::Print;
+                    s->text = decode_string(raw);
+                    finish_line();
+                    return s;
+                }
+            }
+        } else if (accept_word("if")) {
+            return parse_if(s);
+        } else if (accept_word("for")) {
+            return parse_for(s);
+        } else if (is_word("else")) {
+            error(s->loc, "'else' without a matching 'if'");
+            skip_line();
+            return nullptr;
+        } else if (is(Tok::Ident)) {
+            StringRef name = cur().text;
+            next();
+            if (accept(Tok::Assign)) {
+                Expr* v = parse_expr();
+                if (!v) { skip_line(); return nullptr; }
+                s->kind = StmtKind::Assign;
+                s->name = name;
+                s->value = v;
+                finish_line();
+                return s;
+            }
+        }
+        i = save;
+        diag("Warning", s->loc, "skipping unrecognized statement");
+        skip_line();
+        return nullptr;
+    }
+
+    Stmt* parse_if(Stmt* s) {
+        s->kind = StmtKind::If;
+        s->cond = parse_expr();
+        if (!s->cond || !is(Tok::LBrace)) {
+            if (s->cond) error(cur().loc, "expected '{' after if condition");
+            skip_line();
+            return nullptr;
+        }
+        next();
+        s->then_body = parse_body(s->loc);
+        // an else may follow on the same or on a later line
+        size_t save = i;
+        skip_newlines();
+        if (!accept_word("else")) { i = save; return s; }
+        SrcLoc loc = cur().loc;
+        if (accept_word("if")) {
+            Stmt* e = ast_new<Stmt>(A);
+            e->loc = loc;
+            s->else_body = parse_if(e);
+        } else if (accept(Tok::LBrace)) {
+            s->else_body = parse_body(loc);
+        } else {
+            error(loc, "expected '{' or 'if' after else");
+            skip_line();
+        }
+        return s;
+    }
+
+    // for x in seq[a...b:s] { ... } runs the body once per value of the
+    // range, first to last; rcp[...] walks it the other way
+    Stmt* parse_for(Stmt* s) {
+        s->kind = StmtKind::For;
+        if (!is(Tok::Ident)) { error(cur().loc, "expected a loop variable after 'for'"); skip_line(); return nullptr; }
+        s->name = cur().text;
+        next();
+        if (!accept_word("in")) { error(cur().loc, "expected 'in' after the loop variable"); skip_line(); return nullptr; }
+        SrcLoc loc = cur().loc;
+        s->value = parse_primary();
+        if (!s->value) { skip_line(); return nullptr; }
+        if (s->value->kind != ExprKind::Generator || s->value->gen == GenKind::Random) {
+            error(loc, "a for loop walks a seq[...] or rcp[...] range");
+            skip_line();
+            return nullptr;
+        }
+        if (!accept(Tok::LBrace)) { error(cur().loc, "expected '{' after the for range"); skip_line(); return nullptr; }
+        s->then_body = parse_body(s->loc);
+        return s;
+    }
+
+    Expr* new_expr(ExprKind k, SrcLoc loc) {
+        Expr* e = ast_new<Expr>(A);
+        e->kind = k;
+        e->loc = loc;
+        return e;
+    }
+
+    Expr* new_binary(BinOp op, Expr* l, Expr* r) {
+        Expr* e = new_expr(ExprKind::Binary, l->loc);
+        e->op = op;
+        e->lhs = l;
+        e->rhs = r;
+        return e;
+    }
+
+    Expr* parse_expr() {
+        Expr* l = parse_add();
+        if (!l) return nullptr;
+        BinOp op;
+        switch (cur().kind) {
+        case Tok::EqEq:   op = BinOp::Eq; break;
+        case Tok::Assign: op = BinOp::Eq; break;  // xf allows `if a = 60` as a comparison
+        case Tok::NotEq:  op = BinOp::Ne; break;
+        case Tok::Lt:     op = BinOp::Lt; break;
+        case Tok::Le:     op = BinOp::Le; break;
+        case Tok::Gt:     op = BinOp::Gt; break;
+        case Tok::Ge:     op = BinOp::Ge; break;
+        default:          return l;
+        }
+        next();
+        Expr* r = parse_add();
+        return r ? new_binary(op, l, r) : nullptr;
+    }
+
+    Expr* parse_add() {
+        Expr* l = parse_mul();
+        while (l && (is(Tok::Plus) || is(Tok::Minus))) {
+            BinOp op = is(Tok::Plus) ? BinOp::Add : BinOp::Sub;
+            next();
+            Expr* r = parse_mul();
+            l = r ? new_binary(op, l, r) : nullptr;
+        }
+        return l;
+    }
+
+    Expr* parse_mul() {
+        Expr* l = parse_unary();
+        while (l && (is(Tok::Star) || is(Tok::Slash) || is(Tok::Percent))) {
+            BinOp op = is(Tok::Star) ? BinOp::Mul : is(Tok::Slash) ? BinOp::Div : BinOp::Mod;
+            next();
+            Expr* r = parse_unary();
+            l = r ? new_binary(op, l, r) : nullptr;
+        }
+        return l;
+    }
+
+    Expr* parse_unary() {
+        SrcLoc loc = cur().loc;
+        if (accept(Tok::Minus)) {
+            Expr* v = parse_unary();
+            if (!v) return nullptr;
+            Expr* e = new_expr(ExprKind::Neg, loc);
+            e->lhs = v;
+            return e;
+        }
+        return parse_primary();
+    }
+
+    bool parse_int(long long* out) {
+        bool neg = accept(Tok::Minus);
+        if (!is(Tok::Number)) return false;
+        unsigned long long v;
+        if (cur().text.getAsInteger(10, v) || v > (unsigned long long)INT64_MAX + neg) {
+            error(cur().loc, "integer literal %.*s is too large", (int)cur().text.size(), cur().text.data());
+            v = 0;
+        }
+        next();
+        *out = (long long)(neg ? 0 - v : v);
+        return true;
+    }
+
+    Expr* parse_primary() {
+        SrcLoc loc = cur().loc;
+        if (is(Tok::Number)) {
+            Expr* e = new_expr(ExprKind::Int, loc);
+            parse_int(&e->ival);
+            return e;
+        }
+        if (accept(Tok::LParen)) {
+            Expr* e = parse_expr();
+            if (!e) return nullptr;
+            if (!accept(Tok::RParen)) { error(cur().loc, "expected ')'"); return nullptr; }
+            return e;
+        }
+        if (!is(Tok::Ident)) {
+            error(loc, "expected an expression");
+            return nullptr;
+        }
+        StringRef name = cur().text;
+        next();
+        if (!accept(Tok::LBracket)) {
+            Expr* e = new_expr(ExprKind::Var, loc);
+            e->name = name;
+            return e;
+        }
+        GenKind g;
+        if (name == "random" || name == "rnd") g = GenKind::Random;
+        else if (name == "sequential" || name == "seq") g = GenKind::Sequential;
+        else if (name == "reciprocal" || name == "rcp") g = GenKind::Reciprocal;
+        else { error(loc, "unknown generator '%.*s'", (int)name.size(), name.data()); return nullptr; }
+        // [a...b] or [a...b:step]; without a step seq/rcp count towards the
+        // other end, and rcp[a...b:s] is seq[b...a:-s]
+        long long a, b, step = 0;
+        bool ok = parse_int(&a) && accept(Tok::Ellipsis) && parse_int(&b);
+        bool has_step = ok && accept(Tok::Colon);
+        if (has_step) ok = parse_int(&step);
+        if (!ok || !accept(Tok::RBracket)) {
+            error(loc, "Invalid range syntax in %.*s[...]", (int)name.size(), name.data());
+            while (!at_eol() && !is(Tok::RBracket)) next();
+            accept(Tok::RBracket);
+            return nullptr;
+        }
+        if (g == GenKind::Reciprocal) {
+            std::swap(a, b);
+            step = (long long)(0 - (unsigned long long)step);
+        }
+        if (!has_step) step = a <= b ? 1 : -1;
+        if (g == GenKind::Random ? a > b : !check_range(a, b, step)) {
+            error(loc, "Invalid range syntax in %.*s[...]", (int)name.size(), name.data());
+            return nullptr;
+        }
+        Expr* e = new_expr(ExprKind::Generator, loc);
+        e->gen = g;
+        e->first = a;
+        e->last = b;
+        e->step = step;
+        return e;
+    }
+};
+
+static void parse_program(StringRef src, const ModTable* mods, BumpPtrAllocator& A, Program& prog) {
+    if (src.size() >= UINT32_MAX) {
+        std::fprintf(stderr, "Error: input is too large (%zu bytes)\n", src.size());
+        prog.errors++;
+        return;
+    }
+    StructuralIndex idx;
+    build_structural_index(src, idx);
+    std::vector<Token> toks;
+    prog.errors += lex_source(src, idx, toks);
+    if (mods) {
+        std::vector<Token> rewritten;
+        rewrite_tokens(*mods, toks, rewritten);
+        DEBUG_LOG("mods rewrote %zu tokens into %zu\n", toks.size(), rewritten.size());
+        toks.swap(rewritten);
+    }
+    match_braces(toks);
+    DEBUG_LOG("indexed %zu structural characters, lexed %zu tokens\n", idx.offsets.size(), toks.size());
+    Parser P(toks, A, prog);
+    P.parse_program();
+}
+
+// ---------------------------------------------------------------------------
+// Compile-time evaluation
+// -O1 及以上：调用树里没有生成器的函数在编译期直接解释执行，函数体换成它打印的
+// 文本；整个程序不依赖 random[...] 时，main 只剩一次输出。
+// ---------------------------------------------------------------------------
+
+// True when `v` is the generator's last value before it starts over: less
+// than one step is left before `last`. Unsigned, so it cannot overflow.
+static bool generator_past(const Expr* e, int64_t v) {
+    uint64_t left = e->step > 0 ? (uint64_t)e->last - (uint64_t)v : (uint64_t)v - (uint64_t)e->last;
+    uint64_t stride = e->step > 0 ? (uint64_t)e->step : 0 - (uint64_t)e->step;
+    return left < stride;
+}
+
+// Steps a seq/rcp generator takes from `first` to the last value it reaches;
+// a for loop over it runs this many times plus one.
+static uint64_t generator_steps(const Expr* e) {
+    uint64_t span = e->step > 0 ? (uint64_t)e->last - (uint64_t)e->first : (uint64_t)e->first - (uint64_t)e->last;
+    uint64_t stride = e->step > 0 ? (uint64_t)e->step : 0 - (uint64_t)e->step;
+    return span / stride;
+}
+
+#define FOLD_MAX_STEPS 1000000      // statements and expressions per evaluation
+#define FOLD_MAX_OUTPUT (1 << 20)   // bytes printed per evaluation
+#define FOLD_MAX_DEPTH 256          // nested calls
+
+// Runs the AST with the semantics IRGen gives it: 64-bit wrapping arithmetic
+// and one seq/rcp counter per generator expression. Whatever is only known at
+// run time (random[...], a variable read before it is assigned, division by
+// zero, runaway recursion or output) makes the evaluation give up.
+class ConstEval {
+public:
+    explicit ConstEval(const Program& prog) {
+        // the first definition wins, as in IRGen
+        for (const FnDecl* f = prog.fns; f; f = f->next)
+            fns.try_emplace(make_fn_name(f->block.str(), f->name.str()), f);
+    }
+
+    // What one call of `f` prints, if that never changes: nothing below it
+    // uses a generator. Null otherwise.
+    const std::string* fold_function(const FnDecl* f) {
+        auto it = folded.find(f);
+        if (it != folded.end()) return it->second.get();
+        folded[f] = nullptr;                // calling back into f gives up
+        Run r;
+        r.generators = false;
+        if (!exec_fn(r, f)) return nullptr;
+        std::unique_ptr<std::string>& slot = folded[f];
+        slot = std::make_unique<std::string>(std::move(r.out));
+        return slot.get();
+    }
+
+    // Everything the program prints when run from `entry`, seq/rcp included.
+    bool run_program(const FnDecl* entry, std::string& out) {
+        Run r;
+        r.generators = true;
+        if (!exec_fn(r, entry)) return false;
+        out = std::move(r.out);
+        return true;
+    }
+
+private:
+    struct Run {
+        bool generators;
+        std::string out;
+        DenseMap<const Expr*, int64_t> counters;   // next value, as in IRGen's globals
+        unsigned steps = 0, depth = 0;
+    };
+
+    StringMap<const FnDecl*> fns;
+    DenseMap<const FnDecl*, std::unique_ptr<std::string>> folded;
+
+    static bool emit(Run& r, StringRef text) {
+        if (r.out.size() + text.size() > FOLD_MAX_OUTPUT) return false;
+        r.out.append(text.data(), text.size());
+        return true;
+    }
+
+    bool exec_fn(Run& r, const FnDecl* f) {
+        if (r.depth >= FOLD_MAX_DEPTH) return false;
+        StringMap<int64_t> vars;            // locals, like IRGen's allocas
+        r.depth++;
+        bool ok = exec(r, f->body, vars);
+        r.depth--;
+        return ok;
+    }
+
+    bool exec(Run& r, const Stmt* s, StringMap<int64_t>& vars) {
+        for (; s; s = s->next) {
+            if (++r.steps > FOLD_MAX_STEPS) return false;
+            switch (s->kind) {
+            case StmtKind::Print:
+                if (!emit(r, s->text) || !emit(r, "\n")) return false;
+                break;
+            case StmtKind::Call: {
+                const FnDecl* g = fns.lookup(make_fn_name(s->block.str(), s->fn.str()));
+                if (!g) return false;
+                if (const std::string* text = fold_function(g)) {
+                    if (!emit(r, *text)) return false;
+                } else if (!r.generators || !exec_fn(r, g)) {
+                    return false;
+                }
+                break;
+            }
+            case StmtKind::Assign: {
+                int64_t v;
+                if (!eval(r, s->value, vars, v)) return false;
+                vars[s->name] = v;
+                break;
+            }
+            case StmtKind::If: {
+                int64_t c;
+                if (!eval(r, s->cond, vars, c)) return false;
+                if (!exec(r, c ? s->then_body : s->else_body, vars)) return false;
+                break;
+            }
+            case StmtKind::For: {
+                const Expr* g = s->value;
+                uint64_t n = generator_steps(g);
+                for (uint64_t k = 0;; ++k) {
+                    if (++r.steps > FOLD_MAX_STEPS) return false;
+                    vars[s->name] = (int64_t)((uint64_t)g->first + k * (uint64_t)g->step);
+                    if (!exec(r, s->then_body, vars)) return false;
+                    if (k == n) break;
+                }
+                break;
+            }
+            }
+        }
+        return true;
+    }
+
+    // mirrors IRGen::lower_generator
+    static bool next_value(Run& r, const Expr* e, int64_t& v) {
+        if (e->gen == GenKind::Random) return false;
+        auto ins = r.counters.try_emplace(e, e->first);
+        v = ins.first->second;
+        ins.first->second = generator_past(e, v) ? e->first : v + e->step;
+        return true;
+    }
+
+    bool eval(Run& r, const Expr* e, const StringMap<int64_t>& vars, int64_t& v) {
+        if (++r.steps > FOLD_MAX_STEPS) return false;
+        switch (e->kind) {
+        case ExprKind::Int:
+            v = e->ival;
+            return true;
+        case ExprKind::Var: {
+            auto it = vars.find(e->name);
+            if (it == vars.end()) return false;
+            v = it->second;
+            return true;
+        }
+        case ExprKind::Neg:
+            if (!eval(r, e->lhs, vars, v)) return false;
+            v = (int64_t)(0 - (uint64_t)v);
+            return true;
+        case ExprKind::Generator:
+            return r.generators && next_value(r, e, v);
+        case ExprKind::Binary:
+            break;
+        }
+        int64_t l, rv;
+        if (!eval(r, e->lhs, vars, l) || !eval(r, e->rhs, vars, rv)) return false;
+        switch (e->op) {
+        case BinOp::Add: v = (int64_t)((uint64_t)l + (uint64_t)rv); break;
+        case BinOp::Sub: v = (int64_t)((uint64_t)l - (uint64_t)rv); break;
+        case BinOp::Mul: v = (int64_t)((uint64_t)l * (uint64_t)rv); break;
+        case BinOp::Div:
+        case BinOp::Mod:
+            if (rv == 0 || (l == INT64_MIN && rv == -1)) return false;
+            v = e->op == BinOp::Div ? l / rv : l % rv;
+            break;
+        case BinOp::Eq: v = l == rv; break;
+        case BinOp::Ne: v = l != rv; break;
+        case BinOp::Lt: v = l < rv; break;
+        case BinOp::Le: v = l <= rv; break;
+        case BinOp::Gt: v = l > rv; break;
+        case BinOp::Ge: v = l >= rv; break;
+        }
+        return true;
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Lowering: walks the AST once and emits LLVM IR.
+// ---------------------------------------------------------------------------
+
+struct IRGen {
+    LLVMContext& Ctx;
+    Module& M;
+    IRBuilder<> B;
+    Type* I32;
+    Type* Int;                              // xf integers are 64-bit
+    Function* PrintUTF8Func = nullptr;
+    Function* FlushFunc = nullptr;          // main calls it last (--stdout-buffering)
+    StdoutBuffering stdout_buffering = StdoutBuffering::Stdio;
+    CallInst* entry_call = nullptr;         // main's call of the entry function
+    Function* RandFunc = nullptr;           // xf_random, created on first use
+    Optional<uint64_t> seed;                // --seed
+    GlobalValue::LinkageTypes runtime_linkage = GlobalValue::InternalLinkage;
+    int errors = 0;
+    StringMap<Function*> functions;
+    StringMap<Value*> vars;                 // allocas, or globals in a --repl statement
+    Function* cur = nullptr;
+    // functions of the other modules of one program (--repl fragments,
+    // --lto=thin units), mapped to the unit defining them
+    const StringMap<unsigned>* extern_fns = nullptr;
+    unsigned unit = 0;
+    // --repl: top-level variables that earlier fragments defined
+    const StringSet<>* session_vars = nullptr;
+    std::vector<std::string> new_session_vars;
+
+    StringMap<GlobalVariable*> literals;    // one global per distinct text in this module
+    bool fold_output = false;               // -O1 and up: see ConstEval
+    std::unique_ptr<ConstEval> folder;
+
+    explicit IRGen(Module& m) : Ctx(m.getContext()), M(m), B(Ctx), I32(Type::getInt32Ty(Ctx)), Int(Type::getInt64Ty(Ctx)) {}
+
+    // The text as a NUL-terminated i8*, shared by every print of it. Private
+    // unnamed_addr C strings are placed in a mergeable string section, so the
+    // linker can also fold them across objects.
+    Constant* literal(StringRef text) {
+        GlobalVariable*& GV = literals[text];
+        if (!GV) {
+            Constant* Str = ConstantDataArray::getString(Ctx, text);
+            GV = new GlobalVariable(M, Str->getType(), true, GlobalValue::PrivateLinkage, Str, ".str");
+            GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+            GV->setAlignment(Align(1));
+        }
+        Constant* Zero = ConstantInt::get(Type::getInt64Ty(Ctx), 0);
+        Constant* indices[] = { Zero, Zero };
+        return ConstantExpr::getInBoundsGetElementPtr(GV->getValueType(), GV, indices);
+    }
+
+    // A literal that ends another one ("world" and "hello world") points into
+    // the longer one. Sorted by their reversed text, a literal that is a
+    // suffix comes right before the ones it is a suffix of.
+    void share_literal_suffixes() {
+        if (literals.size() < 2) return;
+        std::vector<std::pair<std::string, GlobalVariable*>> rev;
+        for (const auto& l : literals) {
+            std::string key = l.getKey().str();
+            std::reverse(key.begin(), key.end());
+            rev.push_back({key, l.getValue()});
+        }
+        std::sort(rev.begin(), rev.end());
+        Type* I64 = Type::getInt64Ty(Ctx);
+        size_t host = rev.size() - 1;
+        for (size_t k = rev.size() - 1; k-- > 0;) {
+            if (!StringRef(rev[k + 1].first).startswith(rev[k].first)) {
+                host = k;
+                continue;
+            }
+            GlobalVariable* Short = rev[k].second;
+            GlobalVariable* Long = rev[host].second;
+            Constant* indices[] = { ConstantInt::get(I64, 0), ConstantInt::get(I64, rev[host].first.size() - rev[k].first.size()) };
+            Constant* Inner = ConstantExpr::getInBoundsGetElementPtr(Long->getValueType(), Long, indices);
+            Short->replaceAllUsesWith(ConstantExpr::getBitCast(Inner, Short->getType()));
+            Short->eraseFromParent();
+        }
+        literals.clear();
+    }
+
+    Value* get_var(StringRef name) {
+        Value*& slot = vars[name];
+        if (slot) return slot;
+        if (session_vars) {
+            // the first fragment assigning a variable defines it, later ones link to it
+            bool known = session_vars->count(name);
+            slot = new GlobalVariable(M, Int, false, GlobalValue::ExternalLinkage,
+                                      known ? nullptr : ConstantInt::get(Int, 0), "xf.var." + name);
+            if (!known) new_session_vars.push_back(name.str());
+        } else {
+            BasicBlock& entry = cur->getEntryBlock();
+            IRBuilder<> EB(&entry, entry.begin());
+            slot = EB.CreateAlloca(Int, nullptr, name);
+        }
+        return slot;
+    }
+
+    Value* lower_generator(const Expr* e, StringRef var) {
+        if (e->gen == GenKind::Random) {
+            if (!RandFunc) RandFunc = CreateRandomFunction(&M, runtime_linkage, seed);
+            // the span wraps to 0 for the full 64-bit range
+            return B.CreateCall(RandFunc, {ConstantInt::get(Int, e->first),
+                                           ConstantInt::get(Int, (uint64_t)e->last - (uint64_t)e->first + 1)});
+        }
+        // seq/rcp keep the value they hand out next in a per-expression
+        // static, like `static long long __seq_<id>_next`; a step is one add
+        std::string gname = "__seq_" + cur->getName().str() + "_" + var.str() + "_next";
+        Constant* first = ConstantInt::get(Int, e->first);
+        GlobalVariable* next = new GlobalVariable(M, Int, false, GlobalValue::InternalLinkage, first, gname);
+        Value* val = B.CreateLoad(Int, next);
+        Value* left = e->step > 0 ? B.CreateSub(ConstantInt::get(Int, e->last), val)
+                                  : B.CreateSub(val, ConstantInt::get(Int, e->last));
+        uint64_t stride = e->step > 0 ? (uint64_t)e->step : 0 - (uint64_t)e->step;
+        Value* past = B.CreateICmpULT(left, ConstantInt::get(Int, stride));   // see generator_past
+        B.CreateStore(B.CreateSelect(past, first, B.CreateAdd(val, ConstantInt::get(Int, e->step))), next);
+        return val;
+    }
+
+    Value* lower_expr(const Expr* e, StringRef var = StringRef()) {
+        switch (e->kind) {
+        case ExprKind::Int:
+            return ConstantInt::get(Int, e->ival);
+        case ExprKind::Var: {
+            auto it = vars.find(e->name);
+            if (it == vars.end() && session_vars && session_vars->count(e->name)) {
+                get_var(e->name);
+                it = vars.find(e->name);
+            }
+            if (it == vars.end()) {
+                diag("Warning", e->loc, "variable '%.*s' is used before assignment, using 0",
+                     (int)e->name.size(), e->name.data());
+                return ConstantInt::get(Int, 0);
+            }
+            return B.CreateLoad(Int, it->second, e->name);
+        }
+        case ExprKind::Neg:
+            return B.CreateNeg(lower_expr(e->lhs));
+        case ExprKind::Generator:
+            return lower_generator(e, var);
+        case ExprKind::Binary:
+            break;
+        }
+        if (is_compare(e->op)) return B.CreateZExt(lower_cond(e), Int);
+        Value* l = lower_expr(e->lhs);
+        Value* r = lower_expr(e->rhs);
+        switch (e->op) {
+        case BinOp::Add: return B.CreateAdd(l, r);
+        case BinOp::Sub: return B.CreateSub(l, r);
+        case BinOp::Mul: return B.CreateMul(l, r);
+        case BinOp::Div: return B.CreateSDiv(l, r);
+        default:         return B.CreateSRem(l, r);
+        }
+    }
+
+    Value* lower_cond(const Expr* e) {
+        if (e->kind != ExprKind::Binary || !is_compare(e->op))
+            return B.CreateICmpNE(lower_expr(e), ConstantInt::get(Int, 0));
+        Value* l = lower_expr(e->lhs);
+        Value* r = lower_expr(e->rhs);
+        switch (e->op) {
+        case BinOp::Eq: return B.CreateICmpEQ(l, r);
+        case BinOp::Ne: return B.CreateICmpNE(l, r);
+        case BinOp::Lt: return B.CreateICmpSLT(l, r);
+        case BinOp::Le: return B.CreateICmpSLE(l, r);
+        case BinOp::Gt: return B.CreateICmpSGT(l, r);
+        default:        return B.CreateICmpSGE(l, r);
+        }
+    }
+
+    void lower_stmts(const Stmt* s) {
+        for (; s; s = s->next) {
+            switch (s->kind) {
+            case StmtKind::Print: {
+                // A run of prints is one puts of the lines joined by '\n'
+                // (puts adds the last one), so one libc call per run.
+                if (!s->next || s->next->kind != StmtKind::Print) {
+                    B.CreateCall(PrintUTF8Func, {literal(s->text)});
+                    break;
+                }
+                std::string text = s->text.str();
+                for (; s->next && s->next->kind == StmtKind::Print; s = s->next) {
+                    text += '\n';
+                    text += s->next->text;
+                }
+                B.CreateCall(PrintUTF8Func, {literal(text)});
+                break;
+            }
+            case StmtKind::Call: {
+                std::string callee = make_fn_name(s->block.str(), s->fn.str());
+                auto it = functions.find(callee);
+                if (it == functions.end() && extern_fns && extern_fns->count(callee)) {
+                    Function* F = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                                                   Function::ExternalLinkage, callee, &M);
+                    it = functions.insert({callee, F}).first;
+                }
+                if (it == functions.end()) {
+                    diag("Error", s->loc, "unknown function $%.*s@%.*s",
+                         (int)s->block.size(), s->block.data(), (int)s->fn.size(), s->fn.data());
+                    errors++;
+                    break;
+                }
+                B.CreateCall(it->second);
+                break;
+            }
+            case StmtKind::Assign:
+                B.CreateStore(lower_expr(s->value, s->name), get_var(s->name));
+                break;
+            case StmtKind::If: {
+                if (lower_switch_chain(s)) break;
+                Value* CondVal = lower_cond(s->cond);
+                BasicBlock* ThenBB = BasicBlock::Create(Ctx, "if.then", cur);
+                BasicBlock* ElseBB = s->else_body ? BasicBlock::Create(Ctx, "if.else", cur) : nullptr;
+                BasicBlock* MergeBB = BasicBlock::Create(Ctx, "if.merge", cur);
+                B.CreateCondBr(CondVal, ThenBB, ElseBB ? ElseBB : MergeBB);
+                B.SetInsertPoint(ThenBB);
+                lower_stmts(s->then_body);
+                B.CreateBr(MergeBB);
+                if (ElseBB) {
+                    B.SetInsertPoint(ElseBB);
+                    lower_stmts(s->else_body);
+                    B.CreateBr(MergeBB);
+                }
+                B.SetInsertPoint(MergeBB);
+                break;
+            }
+            case StmtKind::For:
+                lower_for(s);
+                break;
+            }
+        }
+    }
+
+    static constexpr unsigned SWITCH_MIN_ARMS = 3;     // shorter if/else-if chains stay compares
+
+    // An if/else-if chain testing one variable against constants becomes a
+    // single switch, which codegen turns into a jump table or a binary
+    // search instead of one compare per arm. The chain ends at the first
+    // arm that tests something else; that arm and the final else form the
+    // default. A repeated constant can never match, its arm is still
+    // lowered (for its diagnostics) but left unreachable.
+    bool lower_switch_chain(const Stmt* s) {
+        std::vector<std::pair<long long, const Stmt*>> arms;
+        const Expr* var = nullptr;
+        const Stmt* rest = s;
+        // an `else if` is the else body's only statement
+        while (rest && rest->kind == StmtKind::If && (rest == s || !rest->next)) {
+            long long c;
+            const Expr* v = match_var_eq_const(rest->cond, c);
+            if (!v || (var && v->name != var->name)) break;
+            var = v;
+            arms.push_back({c, rest});
+            rest = rest->else_body;
+        }
+        if (arms.size() < SWITCH_MIN_ARMS) return false;
+        Value* V = lower_expr(var);
+        BasicBlock* DefaultBB = rest ? BasicBlock::Create(Ctx, "switch.default", cur) : nullptr;
+        BasicBlock* MergeBB = BasicBlock::Create(Ctx, "switch.merge", cur);
+        SwitchInst* SI = B.CreateSwitch(V, DefaultBB ? DefaultBB : MergeBB, arms.size());
+        for (const auto& arm : arms) {
+            BasicBlock* CaseBB = BasicBlock::Create(Ctx, "switch.case", cur);
+            ConstantInt* C = cast<ConstantInt>(ConstantInt::get(Int, arm.first));
+            if (SI->findCaseValue(C) == SI->case_default()) SI->addCase(C, CaseBB);
+            B.SetInsertPoint(CaseBB);
+            lower_stmts(arm.second->then_body);
+            B.CreateBr(MergeBB);
+        }
+        if (DefaultBB) {
+            B.SetInsertPoint(DefaultBB);
+            lower_stmts(rest);
+            B.CreateBr(MergeBB);
+        }
+        B.SetInsertPoint(MergeBB);
+        return true;
+    }
+
+    // A bottom-tested loop with one induction PHI stepping from `first` to
+    // the constant last value, so SCEV knows the trip count and the loop
+    // vectorizer and unroller can take it. The range is never empty. The
+    // body sees the value through the variable's slot, which SROA promotes;
+    // assigning to it in the body does not change the iteration.
+    void lower_for(const Stmt* s) {
+        const Expr* g = s->value;
+        Value* slot = get_var(s->name);
+        uint64_t final_value = (uint64_t)g->first + generator_steps(g) * (uint64_t)g->step;
+        BasicBlock* Preheader = B.GetInsertBlock();
+        BasicBlock* BodyBB = BasicBlock::Create(Ctx, "for.body", cur);
+        BasicBlock* LatchBB = BasicBlock::Create(Ctx, "for.latch", cur);
+        BasicBlock* EndBB = BasicBlock::Create(Ctx, "for.end", cur);
+        B.CreateBr(BodyBB);
+        B.SetInsertPoint(BodyBB);
+        PHINode* IV = B.CreatePHI(Int, 2, s->name);
+        IV->addIncoming(ConstantInt::get(Int, g->first), Preheader);
+        B.CreateStore(IV, slot);
+        lower_stmts(s->then_body);
+        B.CreateBr(LatchBB);
+        B.SetInsertPoint(LatchBB);
+        // every value up to the last one stays inside the range: no wrap
+        Value* Next = B.CreateNSWAdd(IV, ConstantInt::get(Int, g->step), s->name + ".next");
+        B.CreateCondBr(B.CreateICmpEQ(IV, ConstantInt::get(Int, final_value)), EndBB, BodyBB);
+        IV->addIncoming(Next, LatchBB);
+        B.SetInsertPoint(EndBB);
+    }
+
+    void lower_fn(const FnDecl* f, Function* F) {
+        cur = F;
+        vars.clear();
+        B.SetInsertPoint(BasicBlock::Create(Ctx, "entry", F));
+        if (const std::string* text = folder ? folder->fold_function(f) : nullptr)
+            print_output(*text);
+        else
+            lower_stmts(f->body);
+        B.CreateRetVoid();
+    }
+
+    // text that ConstEval collected, every line ending in '\n'
+    void print_output(StringRef text) {
+        if (text.empty()) return;
+        B.CreateCall(PrintUTF8Func, {literal(text.drop_back())});   // puts adds the last '\n'
+    }
+
+    void lower_functions(const Program& prog, GlobalValue::LinkageTypes linkage) {
+        FunctionType* VoidFuncType = FunctionType::get(Type::getVoidTy(Ctx), false);
+
+        // declare every function first so $block@fn may refer forwards
+        std::vector<std::pair<const FnDecl*, Function*>> bodies;
+        for (const FnDecl* f = prog.fns; f; f = f->next) {
+            std::string fname = make_fn_name(f->block.str(), f->name.str());
+            auto other = extern_fns ? extern_fns->find(fname) : StringMap<unsigned>::const_iterator();
+            if (functions.count(fname) || (extern_fns && other != extern_fns->end() && other->second != unit)) {
+                diag("Error", f->loc, "duplicate function %s", fname.c_str());
+                errors++;
+                continue;
+            }
+            Function* F = Function::Create(VoidFuncType, linkage, fname, &M);
+            functions[fname] = F;
+            bodies.push_back({f, F});
+            DEBUG_LOG("Created function: %s\n", fname.c_str());
+        }
+        for (auto& b : bodies) lower_fn(b.first, b.second);
+    }
+
+    void lower_program(const Program& prog) { lower_unit(prog, /*shared=*/false, /*with_main=*/true); }
+
+    // One module of a program. With `shared` its functions stay visible to
+    // the program's other modules (--repl fragments, --lto=thin units);
+    // only the unit `with_main` gets main().
+    // With --stdout-buffering all units must share one buffer, so only the
+    // unit with main defines print_utf8 and the others call it.
+    void lower_unit(const Program& prog, bool shared, bool with_main) {
+        if (stdout_buffering == StdoutBuffering::Stdio) {
+            PrintUTF8Func = CreatePrintUTF8Function(&M, &B);
+            if (shared) PrintUTF8Func->setLinkage(GlobalValue::InternalLinkage);
+        } else if (shared && !with_main) {
+            PrintUTF8Func = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), {Type::getInt8PtrTy(Ctx)}, false),
+                                             Function::ExternalLinkage, "print_utf8", &M);
+        } else {
+            PrintUTF8Func = CreateBufferedPrintFunction(&M, &B, stdout_buffering, &FlushFunc);
+        }
+        runtime_linkage = shared ? GlobalValue::LinkOnceODRLinkage : GlobalValue::InternalLinkage;
+        if (fold_output && !session_vars) folder = std::make_unique<ConstEval>(prog);
+        // a program that never needs rand() prints its whole output from
+        // main; the functions it no longer calls are left to GlobalDCE
+        std::string output;
+        bool folded = folder && with_main && !shared && prog.entry && folder->run_program(prog.entry, output);
+        if (folded) DEBUG_LOG("program output evaluated at compile time (%zu bytes)\n", output.size());
+        lower_functions(prog, shared ? GlobalValue::ExternalLinkage : GlobalValue::InternalLinkage);
+        if (folded) {
+            B.SetInsertPoint(BasicBlock::Create(Ctx, "entry", Function::Create(FunctionType::get(I32, false),
+                                                                               Function::ExternalLinkage, "main", &M)));
+            print_output(output);
+            if (FlushFunc) B.CreateCall(FlushFunc);
+            B.CreateRet(ConstantInt::get(I32, 0));
+        }
+        share_literal_suffixes();
+        if (!with_main || folded) return;
+
+        // main() calls the entry function (xf_random seeds itself)
+        FunctionType* MainType = FunctionType::get(I32, false);
+        Function* MainFunc = Function::Create(MainType, Function::ExternalLinkage, "main", &M);
+        B.SetInsertPoint(BasicBlock::Create(Ctx, "entry", MainFunc));
+        if (prog.entry) {
+            Function* entry = functions.lookup(make_fn_name(prog.entry->block.str(), prog.entry->name.str()));
+            if (entry) entry_call = B.CreateCall(entry);
+        }
+        if (FlushFunc) B.CreateCall(FlushFunc);
+        B.CreateRet(ConstantInt::get(I32, 0));
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Optimization
+// -O1/-O2/-O3/-Os 跑新 pass manager 的标准流水线（内联、SROA、GVN、SCCP 等），
+// -O0 完全跳过 IR 优化，代码生成也用最快的设置。
+// ---------------------------------------------------------------------------
+
+struct OptLevel {
+    char name;                      // '0'..'3' or 's'
+    OptimizationLevel ir;
+    CodeGenOpt::Level codegen;
+};
+
+static bool parse_opt_level(const char* arg, OptLevel& out) {
+    if (arg[0] != '-' || arg[1] != 'O' || arg[2] == '\0' || arg[3] != '\0') return false;
+    switch (arg[2]) {
+    case '0': out = {'0', OptimizationLevel::O0, CodeGenOpt::None}; return true;
+    case '1': out = {'1', OptimizationLevel::O1, CodeGenOpt::Less}; return true;
+    case '2': out = {'2', OptimizationLevel::O2, CodeGenOpt::Default}; return true;
+    case '3': out = {'3', OptimizationLevel::O3, CodeGenOpt::Aggressive}; return true;
+    case 's': out = {'s', OptimizationLevel::Os, CodeGenOpt::Default}; return true;
+    default: return false;
+    }
+}
+
+// With `thin_bitcode` (--lto=thin) the ThinLTO pre-link pipeline runs instead,
+// and the module is written there as bitcode with its summary.
+static void optimize_module(Module& M, TargetMachine* TM, const OptLevel& level, raw_ostream* thin_bitcode = nullptr) {
+    TM->setOptLevel(level.codegen);
+    if (level.ir == OptimizationLevel::O0 && !thin_bitcode) return;
+    if (level.ir == OptimizationLevel::Os) {
+        // lets the code generator pick smaller instruction sequences too
+        for (Function& F : M)
+            if (!F.isDeclaration()) F.addFnAttr(Attribute::OptimizeForSize);
+    }
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB(TM);
+    FAM.registerPass([&] { return TM->getTargetIRAnalysis(); });
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    ModulePassManager MPM;
+    if (!thin_bitcode) {
+        MPM = PB.buildPerModuleDefaultPipeline(level.ir);
+    } else {
+        // at -O0 this still names anonymous globals, which summaries need
+        MPM = PB.buildThinLTOPreLinkDefaultPipeline(level.ir);
+        MPM.addPass(ThinLTOBitcodeWriterPass(*thin_bitcode, nullptr));
+    }
+    MPM.run(M, MAM);
+}
+
+// ---------------------------------------------------------------------------
+// CPU tuning and multiversioning
+// --mcpu/--mattr 决定 TargetMachine 的 CPU 和特性。--multiversion 为每个 x86-64
+// 微架构级别（v2/v3/v4）克隆从入口函数可达、且含循环或调用的 xf 函数，程序启动时
+// 由一个用 CPUID 判断的 resolver 选出最好的一套：ELF 上通过 ifunc，其它格式由
+// main 调用 resolver。只做打印的叶子函数不克隆，代码体积不会按级别数成倍增长。
+// ---------------------------------------------------------------------------
+
+static std::string host_cpu_features() {
+    StringMap<bool> features;
+    std::string out;
+    if (!sys::getHostCPUFeatures(features)) return out;
+    for (const auto& f : features) {
+        if (!out.empty()) out += ',';
+        out += f.getValue() ? '+' : '-';
+        out += f.getKey().str();
+    }
+    return out;
+}
+
+// "x86-64-v3" or just "v3"; returns the level (2..4) or 0
+static int parse_x86_level(StringRef s) {
+    s.consume_front("x86-64-");
+    if (s == "v2") return 2;
+    if (s == "v3") return 3;
+    if (s == "v4") return 4;
+    return 0;
+}
+
+// cpuid(leaf, subleaf) -> {eax, ebx, ecx, edx}
+static Value* emit_cpuid(IRBuilder<>& B, unsigned leaf, unsigned subleaf) {
+    Type* I32 = B.getInt32Ty();
+    StructType* Regs = StructType::get(I32, I32, I32, I32);
+    FunctionType* FT = FunctionType::get(Regs, {I32, I32}, false);
+    InlineAsm* Cpuid = InlineAsm::get(FT, "cpuid", "={ax},={bx},={cx},={dx},{ax},{cx},~{dirflag},~{fpsr},~{flags}", false);
+    return B.CreateCall(FT, Cpuid, {B.getInt32(leaf), B.getInt32(subleaf)});
+}
+
+// Emits `resolver`, which returns the clone for the best level the running
+// CPU supports. It only uses cpuid/xgetbv, so it is safe to run as an ifunc
+// resolver before relocations and constructors. Levels follow the x86-64 psABI.
+static void emit_level_resolver(Module& M, Function* resolver, const std::vector<std::pair<int, Function*>>& clones,
+                                Function* fallback) {
+    LLVMContext& C = M.getContext();
+    IRBuilder<> B(BasicBlock::Create(C, "entry", resolver));
+    Type* I32 = B.getInt32Ty();
+    auto reg = [&](Value* regs, unsigned k) { return B.CreateExtractValue(regs, k); };
+    auto has = [&](Value* r, uint32_t mask) { return B.CreateICmpEQ(B.CreateAnd(r, mask), B.getInt32(mask)); };
+
+    Value* max_leaf = reg(emit_cpuid(B, 0, 0), 0);
+    Value* max_ext = reg(emit_cpuid(B, 0x80000000u, 0), 0);
+    Value* l1 = emit_cpuid(B, 1, 0);
+    Value* ecx1 = reg(l1, 2);
+    // leaves 7 and 0x80000001 are only meaningful if the CPU reports them
+    Value* l7 = emit_cpuid(B, 7, 0);
+    Value* ebx7 = B.CreateSelect(B.CreateICmpUGE(max_leaf, B.getInt32(7)), reg(l7, 1), B.getInt32(0));
+    Value* le = emit_cpuid(B, 0x80000001u, 0);
+    Value* ecxe = B.CreateSelect(B.CreateICmpUGE(max_ext, B.getInt32(0x80000001u)), reg(le, 2), B.getInt32(0));
+
+    // v2: SSE3 SSSE3 CX16 SSE4.1 SSE4.2 POPCNT, LAHF/SAHF
+    Value* v2 = B.CreateAnd(has(ecx1, (1u << 0) | (1u << 9) | (1u << 13) | (1u << 19) | (1u << 20) | (1u << 23)),
+                            has(ecxe, 1u << 0));
+    // XCR0 can only be read when the OS has enabled XSAVE (OSXSAVE, ecx bit 27)
+    BasicBlock* Entry = B.GetInsertBlock();
+    BasicBlock* ReadXcr = BasicBlock::Create(C, "xgetbv", resolver);
+    BasicBlock* Pick = BasicBlock::Create(C, "pick", resolver);
+    B.CreateCondBr(has(ecx1, 1u << 27), ReadXcr, Pick);
+    B.SetInsertPoint(ReadXcr);
+    FunctionType* XgetbvTy = FunctionType::get(StructType::get(I32, I32), {I32}, false);
+    InlineAsm* Xgetbv = InlineAsm::get(XgetbvTy, "xgetbv", "={ax},={dx},{cx},~{dirflag},~{fpsr},~{flags}", false);
+    Value* xcr0_read = reg(B.CreateCall(XgetbvTy, Xgetbv, {B.getInt32(0)}), 0);
+    B.CreateBr(Pick);
+    B.SetInsertPoint(Pick);
+    PHINode* xcr0 = B.CreatePHI(I32, 2);
+    xcr0->addIncoming(B.getInt32(0), Entry);
+    xcr0->addIncoming(xcr0_read, ReadXcr);
+
+    // v3: v2 + AVX AVX2 BMI1 BMI2 F16C FMA LZCNT MOVBE, with YMM state enabled
+    Value* v3 = B.CreateAnd(v2, B.CreateAnd(has(xcr0, 0x6), B.CreateAnd(
+        has(ecx1, (1u << 12) | (1u << 22) | (1u << 28) | (1u << 29)),
+        B.CreateAnd(has(ebx7, (1u << 3) | (1u << 5) | (1u << 8)), has(ecxe, 1u << 5)))));
+    // v4: v3 + AVX512F/BW/CD/DQ/VL, with opmask and ZMM state enabled
+    Value* v4 = B.CreateAnd(v3, B.CreateAnd(has(xcr0, 0xE6),
+        has(ebx7, (1u << 16) | (1u << 17) | (1u << 28) | (1u << 30) | (1u << 31))));
+
+    Value* best = fallback;
+    for (auto it = clones.begin(); it != clones.end(); ++it) {
+        Value* ok = it->first == 2 ? v2 : it->first == 3 ? v3 : v4;
+        best = B.CreateSelect(ok, it->second, best);
+    }
+    B.CreateRet(best);
+}
+
+static bool is_xf_function(const Function* F) {
+    return F && !F->isDeclaration() && F->hasInternalLinkage();
+}
+
+// The functions worth a clone per level: those reachable from `entry` that
+// loop or call another xf function. A caller of a hot function is hot itself,
+// so every path from the dispatched entry to a clone stays within its level;
+// straight-line leaves keep their single baseline copy.
+static std::vector<Function*> hot_functions(Function* entry) {
+    std::vector<Function*> reach{entry};
+    SmallPtrSet<Function*, 16> seen{entry};
+    std::vector<Function*> hot;
+    for (size_t i = 0; i < reach.size(); ++i) {
+        Function* F = reach[i];
+        bool calls = false;
+        for (Instruction& I : instructions(*F)) {
+            CallInst* CI = dyn_cast<CallInst>(&I);
+            Function* callee = CI ? CI->getCalledFunction() : nullptr;
+            if (!is_xf_function(callee)) continue;
+            calls = true;
+            if (seen.insert(callee).second) reach.push_back(callee);
+        }
+        SmallVector<std::pair<const BasicBlock*, const BasicBlock*>, 4> backedges;
+        FindFunctionBackedges(*F, backedges);
+        if (calls || !backedges.empty()) hot.push_back(F);
+    }
+    return hot;
+}
+
+// Clones the hot xf functions once per level; calls inside a clone stay
+// within its level, and the call from main to the entry function is dispatched.
+static void multiversion_module(Module& M, CallInst* entry_call, std::vector<int> levels, bool use_ifunc) {
+    if (!entry_call || levels.empty()) return;
+    Function* entry = entry_call->getCalledFunction();
+    std::vector<Function*> fns = hot_functions(entry);
+    if (fns.empty() || fns[0] != entry) {
+        DEBUG_LOG("multiversion: %s has no loops or calls, nothing to clone\n", entry->getName().str().c_str());
+        return;
+    }
+
+    // lowest level first, so higher ones win in the resolver's select chain
+    std::sort(levels.begin(), levels.end());
+    levels.erase(std::unique(levels.begin(), levels.end()), levels.end());
+    std::vector<std::pair<int, Function*>> entry_clones;
+    for (int level : levels) {
+        std::string cpu = "x86-64-v" + std::to_string(level);
+        std::string suffix = ".x86_64_v" + std::to_string(level);
+        ValueToValueMapTy VMap;
+        std::vector<std::pair<Function*, Function*>> pairs;
+        for (Function* F : fns) {
+            Function* NF = Function::Create(F->getFunctionType(), F->getLinkage(), F->getName() + suffix, &M);
+            VMap[F] = NF;
+            pairs.push_back({F, NF});
+        }
+        for (auto& p : pairs) {
+            SmallVector<ReturnInst*, 4> Returns;
+            CloneFunctionInto(p.second, p.first, VMap, CloneFunctionChangeType::LocalChangesOnly, Returns);
+            p.second->addFnAttr("target-cpu", cpu);
+            p.second->removeFnAttr("target-features");
+        }
+        entry_clones.push_back({level, cast<Function>(VMap[entry])});
+    }
+
+    Type* FnPtr = entry->getType();
+    Function* resolver = Function::Create(FunctionType::get(FnPtr, false), Function::InternalLinkage,
+                                          entry->getName() + ".resolver", &M);
+    emit_level_resolver(M, resolver, entry_clones, entry);
+    if (use_ifunc) {
+        GlobalIFunc* IF = GlobalIFunc::create(entry->getFunctionType(), entry->getAddressSpace(),
+                                              GlobalValue::InternalLinkage, entry->getName() + ".ifunc", resolver, &M);
+        entry_call->setCalledOperand(IF);
+    } else {
+        IRBuilder<> B(entry_call);
+        Value* target = B.CreateCall(resolver);
+        entry_call->setCalledOperand(target);
+    }
+    DEBUG_LOG("multiversioned %zu function(s) for %zu level(s)\n", fns.size(), levels.size());
+}
+
+// ---------------------------------------------------------------------------
+// Code generation
+// --codegen-threads N 把模块按 #block 切成最多 N 份，每份在自己的线程里用自己的
+// LLVMContext 和 TargetMachine 生成目标文件，最后一起交给链接器。同一个 #block 的
+// 函数总在同一份里；各块按指令数从大到小分给当前最轻的那一份。
+// ---------------------------------------------------------------------------
+
+static bool emit_object(Module& M, TargetMachine* TM, SmallVectorImpl<char>& out) {
+    raw_svector_ostream dest(out);
+    legacy::PassManager PM;
+    if (TM->addPassesToEmitFile(PM, dest, nullptr, CodeGenFileType::CGFT_ObjectFile)) {
+        std::fprintf(stderr, "Error: TargetMachine can't emit a file of this type\n");
+        return false;
+    }
+    PM.run(M);
+    return true;
+}
+
+static size_t function_size(const Function& F) {
+    size_t n = 0;
+    for (const BasicBlock& BB : F) n += BB.size();
+    return n;
+}
+
+// A module cut into partitions. The bitcode is written once; every
+// partition loads it lazily and keeps only the bodies it owns.
+struct ModuleSplit {
+    SmallVector<char, 0> bitcode;
+    StringMap<unsigned> owner;              // partition of each function and mutable global
+    unsigned parts = 0;
+};
+
+// Plans at most `n` partitions. `fn_block` maps a function's name to its
+// #block; clones made by --multiversion ("name.x86_64_v3") follow their
+// original, and anything else (main, print_utf8, ...) counts as one group.
+// Internal symbols become hidden externals so the partitions can reference
+// each other; local constants stay local and are loaded by every partition
+// that uses them.
+static ModuleSplit split_by_block(Module& M, const StringMap<std::string>& fn_block, unsigned n) {
+    StringMap<std::vector<Function*>> groups;
+    StringMap<size_t> group_size;
+    for (Function& F : M) {
+        if (F.isDeclaration()) continue;
+        auto it = fn_block.find(F.getName().split('.').first);
+        StringRef block = it != fn_block.end() ? StringRef(it->second) : StringRef();
+        groups[block].push_back(&F);
+        group_size[block] += function_size(F);
+    }
+    std::vector<StringRef> order;
+    for (const auto& g : groups) order.push_back(g.getKey());
+    std::sort(order.begin(), order.end(), [&](StringRef a, StringRef b) {
+        return group_size[a] != group_size[b] ? group_size[a] > group_size[b] : a < b;
+    });
+
+    ModuleSplit split;
+    split.parts = std::min<unsigned>(n, (unsigned)order.size());
+    for (GlobalValue& GV : M.global_values()) {
+        if (!GV.hasLocalLinkage()) continue;
+        if (auto* Var = dyn_cast<GlobalVariable>(&GV))
+            if (Var->isConstant()) continue;
+        GV.setLinkage(GlobalValue::ExternalLinkage);
+        GV.setVisibility(GlobalValue::HiddenVisibility);
+        if (!GV.hasName()) GV.setName("xf.part");
+    }
+    std::vector<size_t> load(split.parts, 0);
+    for (StringRef g : order) {
+        unsigned p = (unsigned)(std::min_element(load.begin(), load.end()) - load.begin());
+        load[p] += group_size[g];
+        for (Function* F : groups[g]) split.owner[F->getName()] = p;
+    }
+    // a mutable global (the seq/rcp indexes) lives with its first user
+    for (GlobalVariable& GV : M.globals()) {
+        if (GV.isDeclaration() || GV.hasLocalLinkage()) continue;
+        unsigned p = 0;
+        for (const User* U : GV.users())
+            if (const auto* I = dyn_cast<Instruction>(U)) { p = split.owner.lookup(I->getFunction()->getName()); break; }
+        split.owner[GV.getName()] = p;
+    }
+    raw_svector_ostream os(split.bitcode);
+    WriteBitcodeToFile(M, os);
+    DEBUG_LOG("split the module into %u partition(s)\n", split.parts);
+    return split;
+}
+
+// Loads partition `k` of `split` into `Ctx`: bodies owned elsewhere are never
+// read, they become declarations.
+static Expected<std::unique_ptr<Module>> load_partition(const ModuleSplit& split, unsigned k, LLVMContext& Ctx) {
+    MemoryBufferRef buf(StringRef(split.bitcode.data(), split.bitcode.size()), "xfawa_module");
+    Expected<std::unique_ptr<Module>> M = getLazyBitcodeModule(buf, Ctx);
+    if (!M) return M;
+    auto owned_elsewhere = [&](const GlobalValue& GV) {
+        auto it = split.owner.find(GV.getName());
+        return it != split.owner.end() && it->second != k;
+    };
+    for (Function& F : **M)
+        if (owned_elsewhere(F)) F.deleteBody();
+    for (GlobalVariable& GV : (*M)->globals())
+        if (!GV.isDeclaration() && owned_elsewhere(GV)) GV.setInitializer(nullptr);
+    if (Error E = (*M)->materializeAll()) return E;
+    // string literals only the other partitions use
+    for (auto it = (*M)->global_begin(); it != (*M)->global_end();) {
+        GlobalVariable& GV = *it++;
+        if (!GV.hasLocalLinkage()) continue;
+        GV.removeDeadConstantUsers();
+        if (GV.use_empty()) GV.eraseFromParent();
+    }
+    return M;
+}
+
+// Code generation for each partition on its own thread, with its own
+// context and TargetMachine.
+static bool codegen_partitions(const ModuleSplit& split, const Target* T,
+                               const std::string& triple, const std::string& cpu, const std::string& features,
+                               CodeGenOpt::Level level, std::vector<SmallVector<char, 0>>& objs) {
+    objs.assign(split.parts, SmallVector<char, 0>());
+    std::vector<char> ok(split.parts, 0);
+    {
+        ThreadPool pool(hardware_concurrency(split.parts));
+        for (unsigned k = 0; k < split.parts; ++k) {
+            pool.async([&, k] {
+                LLVMContext Ctx;
+                auto Part = load_partition(split, k, Ctx);
+                if (!Part) {
+                    std::fprintf(stderr, "Error: %s\n", toString(Part.takeError()).c_str());
+                    return;
+                }
+                TargetOptions opt;
+                std::unique_ptr<TargetMachine> TM(T->createTargetMachine(triple, cpu, features, opt, Reloc::PIC_));
+                TM->setOptLevel(level);
+                ok[k] = emit_object(**Part, TM.get(), objs[k]);
+            });
+        }
+        pool.wait();
+    }
+    return std::find(ok.begin(), ok.end(), 0) == ok.end();
+}
+
+// ---------------------------------------------------------------------------
+// Linking
+// 目标文件只在内存里生成。链接时不经过 shell：直接 spawn 系统的 C 编译器驱动
+// （$XF_CC，默认 cc；Windows 上是 lld-link / link），由它找到 crt 启动文件和 libc。
+// Linux 上目标文件放在 memfd 里，以 /proc/<pid>/fd/<n> 的路径交给链接器，不落盘；
+// 其他系统退回到一个用完即删的临时文件。
+// ---------------------------------------------------------------------------
+
+// runs `args` without a shell; returns its exit status, or -1 if it could not be started
+#ifdef _WIN32
+// _spawnvp joins argv with spaces, so each argument is quoted the way the
+// MSVC runtime splits a command line again
+static std::string quote_win_arg(const std::string& a) {
+    if (!a.empty() && a.find_first_of(" \t\n\v\"") == std::string::npos) return a;
+    std::string out = "\"";
+    size_t slashes = 0;
+    for (char c : a) {
+        if (c == '\\') {
+            slashes++;
+            continue;
+        }
+        // backslashes are only special in front of a quote
+        out.append(c == '"' ? slashes * 2 + 1 : slashes, '\\');
+        slashes = 0;
+        out += c;
+    }
+    out.append(slashes * 2, '\\');
+    out += '"';
+    return out;
+}
+#endif
+
+static int spawn_and_wait(const std::vector<std::string>& args) {
+#ifdef _WIN32
+    std::vector<std::string> quoted;
+    for (const std::string& a : args) quoted.push_back(quote_win_arg(a));
+    const std::vector<std::string>& spawn_args = quoted;
+#else
+    const std::vector<std::string>& spawn_args = args;
+#endif
+    std::vector<char*> argv;
+    for (const std::string& a : spawn_args) argv.push_back(const_cast<char*>(a.c_str()));
+    argv.push_back(nullptr);
+    if (g_debug) {
+        std::fprintf(stderr, "[debug] running:");
+        for (const std::string& a : args) std::fprintf(stderr, " %s", a.c_str());
+        std::fprintf(stderr, "\n");
+    }
+    std::fflush(nullptr);
+#ifdef _WIN32
+    intptr_t rc = _spawnvp(_P_WAIT, args[0].c_str(), argv.data());
+    return rc < 0 ? -1 : (int)rc;
+#else
+    pid_t pid;
+    if (posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0) return -1;
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR) return -1;
+    if (WIFEXITED(status)) return WEXITSTATUS(status) == 127 ? -1 : WEXITSTATUS(status);
+    return 128 + (WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+#endif
+}
+
+// A path under which the linker can read the object: a memfd where the system
+// has one, a temporary file otherwise. Removed on destruction.
+class ObjectHandle {
+public:
+    bool open(StringRef obj) {
+#if defined(__linux__) && defined(SYS_memfd_create)
+        int mfd = (int)syscall(SYS_memfd_create, "xfawa_module.o", 1u /*MFD_CLOEXEC*/);
+        if (mfd >= 0) {
+            if (write_fd(mfd, obj)) {
+                memfd = mfd;
+                path = "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(mfd);
+                return true;
+            }
+            ::close(mfd);
+        }
+#endif
+        int fd;
+        SmallString<128> tmp;
+        if (sys::fs::createTemporaryFile("xfawa_module", "o", fd, tmp)) return false;
+        bool ok = write_fd(fd, obj);
+        ::close(fd);
+        path = std::string(tmp.str());
+        temp = true;
+        return ok;
+    }
+    ~ObjectHandle() {
+#ifndef _WIN32
+        if (memfd >= 0) ::close(memfd);
+#endif
+        if (temp) sys::fs::remove(path);
+    }
+    const std::string& get_path() const { return path; }
+
+private:
+    static bool write_fd(int fd, StringRef data) {
+        raw_fd_ostream os(fd, /*shouldClose=*/false);
+        os << data;
+        os.flush();
+        bool ok = !os.has_error();
+        os.clear_error();
+        return ok;
+    }
+    std::string path;
+    int memfd = -1;
+    bool temp = false;
+};
+
+// returns 0 on success, otherwise the linker's status (-1: no linker could be run)
+static int link_objects(ArrayRef<SmallVector<char, 0>> objs, const char* outfile) {
+    std::vector<std::unique_ptr<ObjectHandle>> handles;
+    for (const auto& obj : objs) {
+        handles.push_back(std::make_unique<ObjectHandle>());
+        if (!handles.back()->open(StringRef(obj.data(), obj.size()))) {
+            std::fprintf(stderr, "Error: Cannot hand the object to the linker\n");
+            return -1;
+        }
+    }
+#ifdef _WIN32
+    const char* linkers[] = {"lld-link", "link"};
+    int rc = -1;
+    for (const char* l : linkers) {
+        std::vector<std::string> args = {l, "/nologo", std::string("/OUT:") + outfile};
+        for (const auto& h : handles) args.push_back(h->get_path());
+        args.push_back("/defaultlib:libcmt");
+        rc = spawn_and_wait(args);
+        if (rc != -1) break;
+    }
+    return rc;
+#else
+    const char* cc = std::getenv("XF_CC");
+    if (!cc || !*cc) cc = "cc";
+    std::vector<std::string> args = {cc, "-o", outfile};
+    for (const auto& h : handles) args.push_back(h->get_path());
+    int rc = spawn_and_wait(args);
+    if (rc == -1) std::fprintf(stderr, "Error: Cannot run the linker driver '%s' (set XF_CC to choose another)\n", cc);
+    return rc;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// JIT
+// --run 在本进程里用 ORC LLJIT 编译并执行程序，不写可执行文件、不调用链接器。
+// 生成的目标代码按模块 IR 的哈希缓存在磁盘上，脚本没有改动时再次运行直接加载缓存，
+// 跳过优化和代码生成。
+// ---------------------------------------------------------------------------
+
+#define JIT_CACHE_MAX_BYTES (256ULL << 20)
+#define JIT_CACHE_MAX_FILES 4096
+
+// Objects keyed by the module identifier, which jit_cache_key sets. Entries
+// carry the "llvmcache-" prefix so llvm::pruneCache can bound the directory:
+// it drops entries unused for a week, then the least recently used ones
+// beyond the size and count caps, at most every 20 minutes.
+class JitObjectCache : public ObjectCache {
+public:
+    explicit JitObjectCache(std::string dir) : dir(std::move(dir)) {}
+
+    static std::string default_dir() {
+        const char* env = std::getenv("XF_CACHE_DIR");
+        if (env && *env) return env;
+        SmallString<256> p;
+        if (!sys::path::cache_directory(p)) return std::string();
+        sys::path::append(p, "xfawac", "jit");
+        return std::string(p.str());
+    }
+
+    bool has(const Module& M) const { return !dir.empty() && sys::fs::exists(path_for(&M)); }
+
+    void notifyObjectCompiled(const Module* M, MemoryBufferRef Obj) override {
+        if (dir.empty() || sys::fs::create_directories(dir)) return;
+        if (!write_file_atomically(path_for(M), Obj.getBuffer()))
+            DEBUG_LOG("could not write the JIT cache entry %s\n", path_for(M).c_str());
+        CachePruningPolicy policy;
+        policy.MaxSizeBytes = JIT_CACHE_MAX_BYTES;
+        policy.MaxSizeFiles = JIT_CACHE_MAX_FILES;
+        if (!pruneCache(dir, policy)) DEBUG_LOG("could not prune the JIT cache %s\n", dir.c_str());
+    }
+
+    std::unique_ptr<MemoryBuffer> getObject(const Module* M) override {
+        if (dir.empty()) return nullptr;
+        auto buf = MemoryBuffer::getFile(path_for(M), /*IsText=*/false, /*RequiresNullTerminator=*/false);
+        if (!buf) return nullptr;
+        DEBUG_LOG("JIT cache hit: %s\n", path_for(M).c_str());
+        return std::move(*buf);
+    }
+
+private:
+    std::string path_for(const Module* M) const {
+        SmallString<256> p(dir);
+        sys::path::append(p, "llvmcache-" + M->getModuleIdentifier() + ".o");
+        return std::string(p.str());
+    }
+
+    std::string dir;
+};
+
+// Everything that decides the generated code: the unoptimized IR, the
+// optimization level, the CPU, and the compiler and LLVM versions.
+static std::string jit_cache_key(const Module& M, const std::string& cpu, const std::string& features, char opt) {
+    std::string ir;
+    raw_string_ostream os(ir);
+    M.print(os, nullptr);
+    os << '\0' << M.getTargetTriple() << '\0' << cpu << '\0' << features << '\0' << opt << '\0'
+       << VERSION << '\0' << LLVM_VERSION_STRING;
+    os.flush();
+    MD5 hash;
+    hash.update(ir);
+    MD5::MD5Result result;
+    hash.final(result);
+    return std::string(result.digest().str());
+}
+
+// An LLJIT for this machine whose programs link against the compiler's own
+// process (puts, getenv, time, ...); `cache` may be null.
+static std::unique_ptr<orc::LLJIT> create_jit(const std::string& cpu, const std::string& features,
+                                              const OptLevel& level, JitObjectCache* cache) {
+    std::string err;
+    if (!InitializeTargetFor(sys::getProcessTriple(), err)) {
+        std::fprintf(stderr, "Error: %s\n", err.c_str());
+        return nullptr;
+    }
+    auto JTMB = orc::JITTargetMachineBuilder::detectHost();
+    if (!JTMB) {
+        std::fprintf(stderr, "Error: %s\n", toString(JTMB.takeError()).c_str());
+        return nullptr;
+    }
+    if (!cpu.empty()) JTMB->setCPU(cpu);
+    if (!features.empty()) {
+        SmallVector<StringRef, 16> fs;
+        StringRef(features).split(fs, ',', -1, false);
+        std::vector<std::string> list(fs.begin(), fs.end());
+        JTMB->addFeatures(list);
+    }
+    JTMB->setCodeGenOptLevel(level.codegen);
+
+    auto J = orc::LLJITBuilder()
+        .setJITTargetMachineBuilder(std::move(*JTMB))
+        .setCompileFunctionCreator([cache](orc::JITTargetMachineBuilder JTMB)
+                                       -> Expected<std::unique_ptr<orc::IRCompileLayer::IRCompiler>> {
+            auto TM = JTMB.createTargetMachine();
+            if (!TM) return TM.takeError();
+            return std::make_unique<orc::TMOwningSimpleCompiler>(std::move(*TM), cache);
+        })
+        .create();
+    if (!J) {
+        std::fprintf(stderr, "Error: %s\n", toString(J.takeError()).c_str());
+        return nullptr;
+    }
+    auto gen = orc::DynamicLibrarySearchGenerator::GetForCurrentProcess((*J)->getDataLayout().getGlobalPrefix());
+    if (!gen) {
+        std::fprintf(stderr, "Error: %s\n", toString(gen.takeError()).c_str());
+        return nullptr;
+    }
+    (*J)->getMainJITDylib().addGenerator(std::move(*gen));
+    return std::move(*J);
+}
+
+// looks up a `void ()` or `int ()` function in the JIT; null if it is missing
+template <typename Fn> static Fn jit_lookup(orc::LLJIT& J, StringRef name) {
+    auto sym = J.lookup(name);
+    if (!sym) {
+        std::fprintf(stderr, "Error: %s\n", toString(sym.takeError()).c_str());
+        return nullptr;
+    }
+#if LLVM_VERSION_MAJOR >= 15
+    return sym->toPtr<Fn>();
+#else
+    return (Fn)(uintptr_t)sym->getAddress();
+#endif
+}
+
+// Compiles `M` with LLJIT and runs its main(); returns main's result, or -1
+// if the JIT could not be set up.
+static int run_jit_module(ThreadSafeModule TSM, const std::string& cpu, const std::string& features,
+                          const OptLevel& level, JitObjectCache* cache) {
+    std::unique_ptr<orc::LLJIT> J = create_jit(cpu, features, level, cache);
+    if (!J) return -1;
+    if (Error E = J->addIRModule(std::move(TSM))) {
+        std::fprintf(stderr, "Error: %s\n", toString(std::move(E)).c_str());
+        return -1;
+    }
+    auto entry = jit_lookup<int (*)()>(*J, "main");
+    if (!entry) return -1;
+    int rc = entry();
+    std::fflush(stdout);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// REPL
+// --repl 每输入一个完整片段（#block、fn 或语句）就把它单独编译成一个新模块，加入同一个
+// LLJIT 会话：#block 和 fn 只是定义（fn 放在 #repl 块里，用 $repl@名字 调用），语句
+// 被包进一个临时函数后立即执行。之前的函数和顶层变量只在被引用时声明，所以每行的
+// 编译量只取决于这一行，而不是整个会话。
+// ---------------------------------------------------------------------------
+
+struct ReplSession {
+    std::unique_ptr<orc::LLJIT> jit;
+    const ModTable* mods = nullptr;
+    StringMap<unsigned> fns;                // every function defined so far, with its fragment
+    StringSet<> vars;                       // top-level variables, kept in xf.var.<name> globals
+    unsigned counter = 0;
+
+    // compiles one complete fragment and runs it if it is a statement
+    void eval(const std::string& text) {
+        StringRef t = StringRef(text).ltrim();
+        bool is_block = t.startswith("#");
+        bool is_fn = t.startswith("fn") && (t.size() == 2 || !is_ident_char(t[2]));
+        std::string line_fn = "line" + std::to_string(++counter);
+        std::string src;
+        if (is_block) src = text;
+        else if (is_fn) src = "#repl {\n" + text + "\n}\n";
+        else src = "#__repl {\nfn " + line_fn + " {\n" + text + "\n}\n}\n";
+
+        BumpPtrAllocator Arena;
+        Program prog;
+        parse_program(src, mods && mods->size() ? mods : nullptr, Arena, prog);
+        if (prog.errors) return;
+
+        auto Ctx = std::make_unique<LLVMContext>();
+        auto M = std::make_unique<Module>("repl." + std::to_string(counter), *Ctx);
+        M->setDataLayout(jit->getDataLayout());
+        M->setTargetTriple(jit->getTargetTriple().str());
+        std::vector<std::string> defined;
+        std::vector<std::string> new_vars;
+        {
+            IRGen gen(*M);
+            gen.extern_fns = &fns;
+            gen.unit = counter;
+            if (!is_block && !is_fn) gen.session_vars = &vars;
+            gen.lower_unit(prog, /*shared=*/true, /*with_main=*/false);
+            if (prog.errors + gen.errors > 0) return;
+            for (const auto& f : gen.functions)
+                if (!f.getValue()->isDeclaration()) defined.push_back(f.getKey().str());
+            new_vars = std::move(gen.new_session_vars);
+        }
+        if (verifyModule(*M, &errs())) {
+            std::fprintf(stderr, "Error: LLVM module verification failed\n");
+            return;
+        }
+        if (Error E = jit->addIRModule(ThreadSafeModule(std::move(M), orc::ThreadSafeContext(std::move(Ctx))))) {
+            std::fprintf(stderr, "Error: %s\n", toString(std::move(E)).c_str());
+            return;
+        }
+        for (const auto& f : defined) fns[f] = counter;
+        for (const auto& v : new_vars) vars.insert(v);
+        if (is_block || is_fn) return;
+        if (auto fn = jit_lookup<void (*)()>(*jit, make_fn_name("__repl", line_fn))) fn();
+        std::fflush(stdout);
+    }
+};
+
+// true once `text` holds a whole fragment: every '{' is closed and a block
+// or fn header has reached its body
+static bool repl_fragment_complete(StringRef text) {
+    int depth = 0;
+    bool opened = false;
+    bool in_str = false;
+    for (size_t k = 0; k < text.size(); ++k) {
+        char c = text[k];
+        if (in_str) {
+            if (c == '\\') ++k;
+            else if (c == '"') in_str = false;
+        } else if (c == '"') {
+            in_str = true;
+        } else if (c == '/' && k + 1 < text.size() && text[k + 1] == '/') {
+            while (k < text.size() && text[k] != '\n') ++k;
+        } else if (c == '{') {
+            depth++;
+            opened = true;
+        } else if (c == '}') {
+            depth--;
+        }
+    }
+    StringRef t = text.ltrim();
+    bool needs_body = t.startswith("#") || (t.startswith("fn") && (t.size() == 2 || !is_ident_char(t[2])));
+    return depth <= 0 && (opened || !needs_body);
+}
+
+static int run_repl(const ModTable* mods, const std::string& cpu, const std::string& features, const OptLevel& level) {
+    ReplSession session;
+    session.mods = mods;
+    session.jit = create_jit(cpu, features, level, nullptr);
+    if (!session.jit) return 12;
+#ifdef _WIN32
+    bool tty = _isatty(_fileno(stdin));
+#else
+    bool tty = isatty(STDIN_FILENO);
+#endif
+    if (tty) std::printf("xfawaPL %s REPL - :quit or end of input to leave\n", VERSION);
+    std::string pending;
+    char line[4096];
+    while (true) {
+        if (tty) {
+            std::printf(pending.empty() ? "xf> " : "... ");
+            std::fflush(stdout);
+        }
+        if (!std::fgets(line, sizeof(line), stdin)) break;
+        StringRef l = StringRef(line).trim();
+        if (pending.empty() && (l == ":quit" || l == ":q")) break;
+        if (pending.empty() && l.empty()) continue;
+        pending += line;
+        if (!repl_fragment_complete(pending)) continue;
+        session.eval(pending);
+        pending.clear();
+    }
+    if (!pending.empty()) std::fprintf(stderr, "Error: unterminated input at end of session\n");
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Driver
+// ---------------------------------------------------------------------------
+
+// State a compile server keeps alive between requests (see run_server).
+struct WarmState {
+    std::string mods_dir;                   // real path of the preloaded mods directory
+    ModTable mods;
+    std::string triple;
+    std::unique_ptr<TargetMachine> tm;
+};
+
+static void print_usage(const char* argv0) {
+    std::fprintf(stderr, "Usage: %s <input.xf|-> [-o output_exe] [-O0|-O1|-O2|-O3|-Os] [--mods-dir <dir>] [--debug] [--keep-temp] [--emit-ir <file>] [--target <triple>] [--mcpu=native|<cpu>] [--mattr=<features>] [--multiversion=x86-64-v2,v3,v4] [--codegen-threads N] [--stdout-buffering=none|line|full] [--seed N] [--time-phases] [--compile-mods]\n", argv0);
+    std::fprintf(stderr, "       %s <input.xf...> [--manifest <list>] [-j N] [other options, except -o/--emit-ir]\n", argv0);
+    std::fprintf(stderr, "       %s --lto=thin <input.xf...> [-o output_exe] [-j N] [-O0|-O1|-O2|-O3|-Os]   (all inputs form one program)\n", argv0);
+    std::fprintf(stderr, "       %s --run <input.xf|-> [-O0|-O1|-O2|-O3|-Os] [--mcpu=native|<cpu>] [--mattr=<features>] [--mods-dir <dir>]\n", argv0);
+    std::fprintf(stderr, "       %s --repl [-O0|-O1|-O2|-O3|-Os] [--mcpu=native|<cpu>] [--mods-dir <dir>]\n", argv0);
+    std::fprintf(stderr, "       %s --server <socket> [--mods-dir <dir>]\n", argv0);
+    std::fprintf(stderr, "       %s --connect <socket> <compile arguments...>\n", argv0);
+    std::fprintf(stderr, "Version: %s\n", VERSION);
+}
+
+// Options that apply to every input of one command line.
+struct CompileOptions {
+    const char* modsdir = "mods";
+    const char* emit_ir_file = nullptr;
+    OptLevel opt_level = {'0', OptimizationLevel::O0, CodeGenOpt::None};
+    std::string triple;
+    const Target* target = nullptr;
+    std::string cpu;                        // "native" is already resolved here
+    std::string features;
+    std::vector<int> mv_levels;
+    unsigned codegen_threads = 1;
+    bool time_phases = false;
+    bool run_jit = false;
+    bool lto_thin = false;
+    StdoutBuffering stdout_buffering = StdoutBuffering::Stdio;
+    Optional<uint64_t> seed;
+};
+
+static std::string default_output_name(const char* infile) {
+    std::string base(std::strcmp(infile, "-") == 0 ? "stdin" : infile);
+    size_t dot = base.rfind('.');
+    if (dot != std::string::npos) base = base.substr(0, dot);
+    return base + "_llvm.exe";
+}
+
+// Compiles one input. Only reads `opts` and `mods`, so batch workers share
+// them; everything LLVM-side (context, module, TargetMachine) is per call.
+static int compile_file(const CompileOptions& opts, const char* infile, std::string outfile,
+                        const ModTable* mods, WarmState* warm, PhaseTimer& timer) {
+    DEBUG_LOG("Input: '%s', Output: '%s', Mods dir: '%s'\n",
+              infile, outfile.empty() ? "(default)" : outfile.c_str(), opts.modsdir ? opts.modsdir : "(null)");
+    SourceBuffer input;
+    if (!input.open(infile)) {
+        std::fprintf(stderr, "Error: Cannot open input file %s: %s\n", infile, input.error().c_str());
+        return 2;
+    }
+    StringRef code = input.text();
+    DEBUG_LOG("read input file, size=%zu (%s)\n", code.size(), input.is_mapped() ? "mmap" : "read");
+    timer.mark("read");
     
-    // Create main function that calls the entry function
-    FunctionType* MainType = FunctionType::get(Type::getInt32Ty(Context), false);
-    Function* MainFunc = Function::Create(MainType, Function::ExternalLinkage, "main", M.get());
-    BasicBlock* MainBB = BasicBlock::Create(Context, "entry", MainFunc);
-    Builder.SetInsertPoint(MainBB);
-    
-    // Call the entry function if it exists
-    if (!entry_fn.empty() && created_functions.find(entry_fn) != created_functions.end()) {
-        Builder.CreateCall(created_functions[entry_fn]);
+    BumpPtrAllocator Arena;
+    Program prog;
+    parse_program(code, mods->size() ? mods : nullptr, Arena, prog);
+    timer.mark("parse");
+    if (!prog.fns) {
+        std::fprintf(stderr, "Error: No functions found in code\n");
+        return 5;
     }
+    DEBUG_LOG("parsed program, entry_fn='%.*s', arena=%zu bytes\n",
+              prog.entry ? (int)prog.entry->name.size() : 0, prog.entry ? prog.entry->name.data() : "",
+              Arena.getTotalMemory());
     
-    // Return 0 from main
-    Builder.CreateRet(ConstantInt::get(Type::getInt32Ty(Context), 0));
+    // the context is heap-allocated so that --run can hand it to the JIT
+    auto OwnedContext = std::make_unique<LLVMContext>();
+    LLVMContext& Context = *OwnedContext;
+    std::unique_ptr<Module> M = std::make_unique<Module>("xfawa_module", Context);
+    M->setTargetTriple(opts.triple);
+    CallInst* entry_call = nullptr;
+    {
+        IRGen gen(*M);
+        gen.stdout_buffering = opts.stdout_buffering;
+        gen.fold_output = opts.opt_level.name != '0';
+        gen.seed = opts.seed;
+        gen.lower_program(prog);
+        if (prog.errors + gen.errors > 0) {
+            std::fprintf(stderr, "Error: %d error(s), no output generated\n", prog.errors + gen.errors);
+            return 3;
+        }
+        entry_call = gen.entry_call;
+    }
     
     // Verify the module
     if (verifyModule(*M, &errs())) {
@@ -861,88 +3364,758 @@ int main(int argc, char** argv) {
     }
     
     DEBUG_LOG("LLVM IR generated successfully\n");
+    timer.mark("irgen");
     
-    if (!outfile) {
-        std::string base(infile);
-        size_t dot = base.rfind('.');
-        if (dot != std::string::npos) base = base.substr(0, dot);
-        base += "_llvm.exe";
-        outfile = strdup(base.c_str());
-    }
+    if (outfile.empty() && !opts.run_jit) outfile = default_output_name(infile);
     
-    std::string TargetTriple = sys::getDefaultTargetTriple();
-    M->setTargetTriple(TargetTriple);
+    const std::string& TargetTriple = opts.triple;
     
-    std::string Error;
-    const Target* TheTarget = TargetRegistry::lookupTarget(TargetTriple, Error);
-    if (!TheTarget) {
-        std::fprintf(stderr, "Error: %s\n", Error.c_str());
-        return 7;
+    std::unique_ptr<TargetMachine> OwnedTM;
+    TargetMachine* TM = nullptr;
+    if (warm && warm->tm && warm->triple == TargetTriple && opts.cpu.empty() && opts.features.empty()) {
+        TM = warm->tm.get();
+    } else {
+        TargetOptions opt;
+        // an empty CPU is each backend's own generic model ("generic-rv64" on RISC-V, ...)
+        OwnedTM.reset(opts.target->createTargetMachine(TargetTriple, opts.cpu, opts.features, opt, Reloc::PIC_));
+        TM = OwnedTM.get();
     }
     
-    TargetOptions opt;
-    std::unique_ptr<TargetMachine> TM(TheTarget->createTargetMachine(
-        TargetTriple, "generic", "", opt, Reloc::PIC_));
-    
     M->setDataLayout(TM->createDataLayout());
+    timer.mark("target init");
     
-    std::string objfile = std::string(outfile) + ".o";
-    std::error_code EC;
-    raw_fd_ostream dest(objfile, EC, sys::fs::OF_None);
-    if (EC) {
-        std::fprintf(stderr, "Error: Could not open file: %s\n", EC.message().c_str());
-        return 8;
+    if (!opts.mv_levels.empty()) {
+        Triple T(TargetTriple);
+        if (opts.run_jit)
+            std::fprintf(stderr, "Warning: --multiversion is ignored with --run; use --mcpu=native instead\n");
+        else if (T.getArch() != Triple::x86_64)
+            std::fprintf(stderr, "Warning: --multiversion only applies to x86-64 targets, ignored\n");
+        else
+            // split builds dispatch through the resolver call, so that no
+            // partition has to carry an ifunc for another one's function
+            multiversion_module(*M, entry_call, opts.mv_levels, T.isOSBinFormatELF() && opts.codegen_threads <= 1);
     }
     
-    legacy::PassManager PM;
-    if (TM->addPassesToEmitFile(PM, dest, nullptr, CodeGenFileType::CGFT_ObjectFile)) {
-        std::fprintf(stderr, "Error: TargetMachine can't emit a file of this type\n");
-        return 9;
+    // an unchanged script finds its object in the JIT cache and skips
+    // optimization too, unless the optimized IR was asked for
+    std::unique_ptr<JitObjectCache> jit_cache;
+    bool jit_cached = false;
+    if (opts.run_jit) {
+        jit_cache = std::make_unique<JitObjectCache>(JitObjectCache::default_dir());
+        M->setModuleIdentifier(jit_cache_key(*M, opts.cpu, opts.features, opts.opt_level.name));
+        jit_cached = !opts.emit_ir_file && jit_cache->has(*M);
     }
     
-    PM.run(*M);
-    dest.flush();
-    dest.close();
+    if (!jit_cached) optimize_module(*M, TM, opts.opt_level);
+    timer.mark("optimize");
     
-    DEBUG_LOG("LLVM object file generated: %s\n", objfile.c_str());
+    if (opts.emit_ir_file) {
+        std::error_code IREC;
+        raw_fd_ostream irout(opts.emit_ir_file, IREC, sys::fs::OF_Text);
+        if (IREC) {
+            std::fprintf(stderr, "Error: Could not open file: %s\n", IREC.message().c_str());
+            return 8;
+        }
+        M->print(irout, nullptr);
+        DEBUG_LOG("IR written to %s\n", opts.emit_ir_file);
+    }
     
-    std::string linker = "lld";
-    std::string cmd;
-#ifdef _WIN32
-    cmd = linker + " /OUT:\"" + std::string(outfile) + "\" \"" + objfile + "\"";
-#else
-    cmd = linker + " -o \"" + std::string(outfile) + "\" \"" + objfile + "\"";
-#endif
-    int rc = std::system(cmd.c_str());
+    if (opts.run_jit) {
+        OwnedTM.reset();
+        int rc = run_jit_module(ThreadSafeModule(std::move(M), orc::ThreadSafeContext(std::move(OwnedContext))),
+                                opts.cpu, opts.features, opts.opt_level, jit_cache.get());
+        timer.mark("jit + run");
+        return rc < 0 ? 12 : rc;
+    }
     
-    if (rc != 0) {
-#ifdef _WIN32
-        linker = "link";
-        cmd = linker + " /OUT:\"" + std::string(outfile) + "\" \"" + objfile + "\"";
-#else
-        linker = "ld";
-        cmd = linker + " -o \"" + std::string(outfile) + "\" \"" + objfile + "\"";
-#endif
-        rc = std::system(cmd.c_str());
+    std::vector<SmallVector<char, 0>> objs;
+    if (opts.codegen_threads > 1) {
+        StringMap<std::string> fn_block;
+        for (const FnDecl* f = prog.fns; f; f = f->next)
+            fn_block[make_fn_name(f->block.str(), f->name.str())] = f->block.str();
+        ModuleSplit split = split_by_block(*M, fn_block, opts.codegen_threads);
+        timer.mark("split");
+        if (!codegen_partitions(split, opts.target, TargetTriple, opts.cpu, opts.features, opts.opt_level.codegen, objs))
+            return 9;
+    } else {
+        objs.emplace_back();
+        if (!emit_object(*M, TM, objs.back())) return 9;
+    }
+    timer.mark("codegen");
+    DEBUG_LOG("LLVM object(s) generated in memory: %zu\n", objs.size());
+    
+    if (g_keep_temp) {
+        for (size_t k = 0; k < objs.size(); ++k) {
+            std::string objfile = objs.size() == 1 ? outfile + ".o" : outfile + "." + std::to_string(k) + ".o";
+            std::error_code EC;
+            raw_fd_ostream keep(objfile, EC, sys::fs::OF_None);
+            if (EC) {
+                std::fprintf(stderr, "Error: Could not open file: %s\n", EC.message().c_str());
+                return 8;
+            }
+            keep << StringRef(objs[k].data(), objs[k].size());
+            std::printf("Temp object file kept: %s\n", objfile.c_str());
+        }
     }
     
+    int rc = link_objects(objs, outfile.c_str());
+    timer.mark("link");
     if (rc != 0) {
-        std::fprintf(stderr, "Error: Linking failed. Object file: %s\n", objfile.c_str());
-        if (!g_keep_temp) {
-            std::remove(objfile.c_str());
+        std::fprintf(stderr, "Error: Linking failed\n");
+        return 10;
+    }
+    
+    std::printf("Generated: %s\n", outfile.c_str());
+    DEBUG_LOG("LLVM machine code generated and linked successfully\n");
+    
+    return 0;
+}
+
+// --manifest: one input path per line; blank lines and lines starting with
+// ';' are skipped
+static bool read_manifest(const char* path, std::vector<std::string>& inputs) {
+    SourceBuffer list;
+    if (!list.open(path)) {
+        std::fprintf(stderr, "Error: Cannot open manifest %s: %s\n", path, list.error().c_str());
+        return false;
+    }
+    SmallVector<StringRef, 64> lines;
+    list.text().split(lines, '\n', -1, false);
+    for (StringRef l : lines) {
+        l = l.trim();
+        if (!l.empty() && !l.startswith(";")) inputs.push_back(l.str());
+    }
+    return true;
+}
+
+// Compiles every input on a pool of `jobs` threads (0: one per core). The
+// result is the exit code of the first input, in command-line order, that
+// failed.
+static int compile_batch(const CompileOptions& opts, const std::vector<std::string>& inputs,
+                         const ModTable* mods, unsigned jobs) {
+    std::vector<int> results(inputs.size(), 0);
+    {
+        ThreadPool pool(jobs ? hardware_concurrency(jobs) : hardware_concurrency());
+        DEBUG_LOG("compiling %zu input(s) on %u thread(s)\n", inputs.size(), pool.getThreadCount());
+        for (size_t k = 0; k < inputs.size(); ++k) {
+            pool.async([&, k] {
+                g_diag_file = inputs[k].c_str();
+                PhaseTimer timer;
+                timer.enabled = opts.time_phases;
+                results[k] = compile_file(opts, inputs[k].c_str(), std::string(), mods, nullptr, timer);
+                if (results[k]) std::fprintf(stderr, "Error: %s: compilation failed (exit %d)\n", inputs[k].c_str(), results[k]);
+                g_diag_file = nullptr;
+            });
+        }
+        pool.wait();
+    }
+    size_t failed = 0;
+    int rc = 0;
+    for (int r : results) {
+        if (!r) continue;
+        if (!failed++) rc = r;
+    }
+    if (failed) std::fprintf(stderr, "Error: %zu of %zu input(s) failed\n", failed, inputs.size());
+    return rc;
+}
+
+// --lto=thin: all inputs form one program. Each file is lowered into its own
+// unit on a worker thread, run through the ThinLTO pre-link pipeline and
+// written as bitcode with a summary; lto::LTO then imports across units, so
+// small helper blocks get inlined where other files call them, and runs the
+// backends in parallel. main() goes into the unit holding the entry function.
+static int compile_thin_lto(const CompileOptions& opts, const std::vector<std::string>& inputs, std::string outfile,
+                            const ModTable* mods, unsigned jobs, PhaseTimer& timer) {
+    struct Unit {
+        SourceBuffer input;
+        BumpPtrAllocator arena;
+        Program prog;
+        SmallVector<char, 0> bitcode;
+        int rc = 0;
+    };
+    ThreadPoolStrategy threads = jobs ? hardware_concurrency(jobs) : hardware_concurrency();
+    std::vector<std::unique_ptr<Unit>> units;
+    for (size_t k = 0; k < inputs.size(); ++k) units.push_back(std::make_unique<Unit>());
+    auto failed = [&](const char* phase) {
+        int rc = 0;
+        for (size_t k = 0; k < units.size(); ++k) {
+            if (!units[k]->rc) continue;
+            std::fprintf(stderr, "Error: %s: %s failed (exit %d)\n", inputs[k].c_str(), phase, units[k]->rc);
+            if (!rc) rc = units[k]->rc;
+        }
+        return rc;
+    };
+
+    {
+        ThreadPool pool(threads);
+        for (size_t k = 0; k < units.size(); ++k) {
+            pool.async([&, k] {
+                Unit& u = *units[k];
+                g_diag_file = inputs[k].c_str();
+                if (!u.input.open(inputs[k].c_str())) {
+                    std::fprintf(stderr, "Error: Cannot open input file %s: %s\n", inputs[k].c_str(), u.input.error().c_str());
+                    u.rc = 2;
+                } else {
+                    // every worker reads the same mod table, which is immutable once attached
+                    parse_program(u.input.text(), mods->size() ? mods : nullptr, u.arena, u.prog);
+                    if (u.prog.errors) u.rc = 3;
+                }
+                g_diag_file = nullptr;
+            });
+        }
+        pool.wait();
+    }
+    if (int rc = failed("parsing")) return rc;
+    timer.mark("parse");
+
+    // which unit defines each function; a later duplicate is reported by IRGen
+    StringMap<unsigned> fn_unit;
+    unsigned entry_unit = 0;
+    bool have_entry = false;
+    for (unsigned k = 0; k < units.size(); ++k) {
+        const Program& prog = units[k]->prog;
+        for (const FnDecl* f = prog.fns; f; f = f->next)
+            fn_unit.insert({make_fn_name(f->block.str(), f->name.str()), k});
+        if (!have_entry && prog.entry && is_entry_name(prog.entry->name)) {
+            entry_unit = k;
+            have_entry = true;
+        }
+    }
+    if (!units[entry_unit]->prog.entry) {
+        std::fprintf(stderr, "Error: No functions found in code\n");
+        return 5;
+    }
+
+    {
+        ThreadPool pool(threads);
+        for (unsigned k = 0; k < units.size(); ++k) {
+            pool.async([&, k] {
+                Unit& u = *units[k];
+                g_diag_file = inputs[k].c_str();
+                LLVMContext Ctx;
+                Module M(inputs[k], Ctx);
+                M.setTargetTriple(opts.triple);
+                {
+                    IRGen gen(M);
+                    gen.extern_fns = &fn_unit;
+                    gen.unit = k;
+                    gen.stdout_buffering = opts.stdout_buffering;
+                    gen.fold_output = opts.opt_level.name != '0';
+                    gen.seed = opts.seed;
+                    gen.lower_unit(u.prog, /*shared=*/true, /*with_main=*/k == entry_unit);
+                    if (u.prog.errors + gen.errors > 0) u.rc = 3;
+                }
+                if (!u.rc && verifyModule(M, &errs())) u.rc = 6;
+                if (!u.rc) {
+                    TargetOptions to;
+                    std::unique_ptr<TargetMachine> TM(
+                        opts.target->createTargetMachine(opts.triple, opts.cpu, opts.features, to, Reloc::PIC_));
+                    M.setDataLayout(TM->createDataLayout());
+                    raw_svector_ostream os(u.bitcode);
+                    optimize_module(M, TM.get(), opts.opt_level, &os);
+                }
+                g_diag_file = nullptr;
+            });
+        }
+        pool.wait();
+    }
+    if (int rc = failed("compilation")) return rc;
+    timer.mark("prelink");
+
+    lto::Config conf;
+    conf.CPU = opts.cpu;
+    SmallVector<StringRef, 16> fs;
+    StringRef(opts.features).split(fs, ',', -1, false);
+    for (StringRef f : fs) conf.MAttrs.push_back(f.str());
+    conf.RelocModel = Reloc::PIC_;
+    conf.CGOptLevel = opts.opt_level.codegen;
+    conf.OptLevel = opts.opt_level.name == 's' ? 2 : (unsigned)(opts.opt_level.name - '0');
+    conf.DiagHandler = [](const DiagnosticInfo& DI) {
+        DiagnosticPrinterRawOStream DP(errs());
+        errs() << (DI.getSeverity() == DS_Error ? "Error: " : "Warning: ");
+        DI.print(DP);
+        errs() << "\n";
+    };
+    lto::LTO L(std::move(conf), lto::createInProcessThinBackend(threads));
+    StringSet<> prevailing;
+    for (unsigned k = 0; k < units.size(); ++k) {
+        const SmallVector<char, 0>& bc = units[k]->bitcode;
+        auto in = lto::InputFile::create(MemoryBufferRef(StringRef(bc.data(), bc.size()), inputs[k]));
+        if (!in) {
+            std::fprintf(stderr, "Error: %s: %s\n", inputs[k].c_str(), toString(in.takeError()).c_str());
+            return 9;
         }
+        // we are the linker: the first definition of each symbol prevails
+        // (duplicate functions were rejected above, so only the runtime's
+        // linkonce_odr copies repeat) and only main is seen from outside
+        std::vector<lto::SymbolResolution> res;
+        for (const lto::InputFile::Symbol& sym : (*in)->symbols()) {
+            lto::SymbolResolution r;
+            if (!sym.isUndefined()) {
+                r.Prevailing = prevailing.insert(sym.getName()).second;
+                r.FinalDefinitionInLinkageUnit = true;
+                r.VisibleToRegularObj = sym.getName() == "main";
+            }
+            res.push_back(r);
+        }
+        if (Error E = L.add(std::move(*in), res)) {
+            std::fprintf(stderr, "Error: %s: %s\n", inputs[k].c_str(), toString(std::move(E)).c_str());
+            return 9;
+        }
+    }
+    std::vector<SmallVector<char, 0>> objs(L.getMaxTasks());
+    Error E = L.run([&](unsigned task) -> Expected<std::unique_ptr<CachedFileStream>> {
+        return std::make_unique<CachedFileStream>(std::make_unique<raw_svector_ostream>(objs[task]));
+    });
+    if (E) {
+        std::fprintf(stderr, "Error: %s\n", toString(std::move(E)).c_str());
+        return 9;
+    }
+    // task 0 is the regular (non-thin) LTO partition, empty here
+    objs.erase(std::remove_if(objs.begin(), objs.end(), [](const SmallVector<char, 0>& o) { return o.empty(); }), objs.end());
+    timer.mark("thinlto");
+
+    if (outfile.empty()) outfile = default_output_name(inputs[0].c_str());
+    int rc = link_objects(objs, outfile.c_str());
+    timer.mark("link");
+    if (rc != 0) {
+        std::fprintf(stderr, "Error: Linking failed\n");
         return 10;
     }
+    std::printf("Generated: %s\n", outfile.c_str());
+    return 0;
+}
+
+// One command line, without --server/--connect. `warm` is non-null inside a
+// compile server.
+static int compile_main(int argc, char** argv, WarmState* warm) {
+    CompileOptions opts;
+    std::vector<std::string> inputs;
+    const char* outfile = nullptr;
+    const char* target_triple = nullptr;
+    unsigned jobs = 0;
+    int self_test = 0;
+    int compile_mods = 0;
+    int repl = 0;
+    PhaseTimer timer;
     
-    if (!g_keep_temp) {
-        std::remove(objfile.c_str());
-        DEBUG_LOG("removed temp object file: %s\n", objfile.c_str());
-    } else {
-        std::printf("Temp object file kept: %s\n", objfile.c_str());
+    // 重置全局标志
+    g_debug = 0;
+    g_keep_temp = 0;
+    
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "-o") == 0 && i+1 < argc) {
+            outfile = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--mods-dir") == 0 && i+1 < argc) {
+            opts.modsdir = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--debug") == 0) {
+            g_debug = 1;
+            DEBUG_LOG("Debug mode enabled\n");
+        }
+        else if (std::strcmp(argv[i], "--keep-temp") == 0) {
+            g_keep_temp = 1;
+            DEBUG_LOG("Keeping temporary files\n");
+        }
+        else if (std::strcmp(argv[i], "--emit-ir") == 0 && i+1 < argc) {
+            opts.emit_ir_file = argv[++i];
+            DEBUG_LOG("Will emit IR to: %s\n", opts.emit_ir_file);
+        }
+        else if (std::strcmp(argv[i], "--target") == 0 && i+1 < argc) {
+            target_triple = argv[++i];
+        }
+        else if (parse_opt_level(argv[i], opts.opt_level)) {
+            DEBUG_LOG("Optimization level: -O%c\n", opts.opt_level.name);
+        }
+        else if (std::strncmp(argv[i], "-j", 2) == 0 && (argv[i][2] != '\0' || i+1 < argc)) {
+            jobs = (unsigned)std::atoi(argv[i][2] ? argv[i] + 2 : argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--codegen-threads") == 0 && i+1 < argc) {
+            int n = std::atoi(argv[++i]);
+            opts.codegen_threads = n > 0 ? (unsigned)n : std::max(1u, std::thread::hardware_concurrency());
+        }
+        else if (std::strcmp(argv[i], "--manifest") == 0 && i+1 < argc) {
+            if (!read_manifest(argv[++i], inputs)) return 2;
+        }
+        else if (std::strncmp(argv[i], "--mcpu=", 7) == 0 || (std::strcmp(argv[i], "--mcpu") == 0 && i+1 < argc)) {
+            opts.cpu = argv[i][6] == '=' ? argv[i] + 7 : argv[++i];
+        }
+        else if (std::strncmp(argv[i], "--mattr=", 8) == 0 || (std::strcmp(argv[i], "--mattr") == 0 && i+1 < argc)) {
+            if (!opts.features.empty()) opts.features += ',';
+            opts.features += argv[i][7] == '=' ? argv[i] + 8 : argv[++i];
+        }
+        else if (std::strncmp(argv[i], "--multiversion=", 15) == 0) {
+            SmallVector<StringRef, 4> parts;
+            StringRef(argv[i] + 15).split(parts, ',', -1, false);
+            for (StringRef p : parts) {
+                int level = parse_x86_level(p.trim());
+                if (level) opts.mv_levels.push_back(level);
+                else std::fprintf(stderr, "Warning: unknown --multiversion level '%.*s' (expected x86-64-v2, v3 or v4)\n", (int)p.size(), p.data());
+            }
+        }
+        else if (std::strncmp(argv[i], "--stdout-buffering=", 19) == 0) {
+            if (!parse_stdout_buffering(argv[i] + 19, opts.stdout_buffering)) {
+                std::fprintf(stderr, "Error: unknown --stdout-buffering mode '%s' (expected none, line or full)\n", argv[i] + 19);
+                return 1;
+            }
+        }
+        else if (std::strncmp(argv[i], "--seed=", 7) == 0 || (std::strcmp(argv[i], "--seed") == 0 && i+1 < argc)) {
+            const char* v = argv[i][6] == '=' ? argv[i] + 7 : argv[++i];
+            uint64_t n;
+            if (StringRef(v).getAsInteger(0, n)) {
+                std::fprintf(stderr, "Error: --seed expects an unsigned 64-bit number, got '%s'\n", v);
+                return 1;
+            }
+            opts.seed = n;
+        }
+        else if (std::strcmp(argv[i], "--time-phases") == 0) {
+            timer.enabled = opts.time_phases = true;
+        }
+        else if (std::strcmp(argv[i], "--run") == 0) {
+            opts.run_jit = true;
+        }
+        else if (std::strncmp(argv[i], "--lto=", 6) == 0) {
+            if (std::strcmp(argv[i] + 6, "thin") == 0) opts.lto_thin = true;
+            else std::fprintf(stderr, "Warning: unknown LTO mode '%s' (only --lto=thin is supported)\n", argv[i] + 6);
+        }
+        else if (std::strcmp(argv[i], "--repl") == 0) {
+            repl = 1;
+        }
+        else if (std::strcmp(argv[i], "--compile-mods") == 0) {
+            compile_mods = 1;
+        }
+        else if (std::strcmp(argv[i], "--self-test") == 0) {
+            self_test = 1;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            // 忽略未知选项，避免崩溃
+            DEBUG_LOG("Unknown option: %s\n", argv[i]);
+        }
+        else {
+            inputs.push_back(argv[i]);
+        }
     }
     
-    std::printf("Generated: %s\n", outfile);
-    DEBUG_LOG("LLVM machine code generated and linked successfully\n");
+    // 自测试模式
+    if (self_test) {
+        DEBUG_LOG("Running self-test...\n");
+        std::fprintf(stderr, "Self-test not implemented yet\n");
+        return 0;
+    }
+    
+    // 预编译 mods 目录为 .xfmodc，之后的编译直接映射它
+    if (compile_mods) {
+        ModTable mods;
+        if (!load_mod_dir(opts.modsdir, mods, /*force=*/true)) {
+            std::fprintf(stderr, "Error: Cannot build the mod pack for %s\n", opts.modsdir);
+            return 8;
+        }
+        std::printf("Compiled %zu mod rule(s) into %s\n", mods.size(), mod_pack_path(opts.modsdir).c_str());
+        return 0;
+    }
+    
+    if (opts.cpu == "native") {
+        opts.cpu = sys::getHostCPUName().str();
+        std::string host = host_cpu_features();
+        opts.features = opts.features.empty() ? host : host + "," + opts.features;
+        DEBUG_LOG("native CPU: %s\n", opts.cpu.c_str());
+    }
+    
+    if (repl) {
+        ModTable mods;
+        load_mod_dir(opts.modsdir, mods, /*force=*/false);
+        return run_repl(&mods, opts.cpu, opts.features, opts.opt_level);
+    }
+    
+    if (inputs.empty()) {
+        std::fprintf(stderr, "Error: No input file specified\n");
+        return 1;
+    }
+    if (opts.lto_thin && (opts.emit_ir_file || opts.run_jit)) {
+        std::fprintf(stderr, "Error: --emit-ir and --run cannot be combined with --lto=thin\n");
+        return 1;
+    }
+    if (inputs.size() > 1 && !opts.lto_thin && (outfile || opts.emit_ir_file || opts.run_jit)) {
+        std::fprintf(stderr, "Error: -o, --emit-ir and --run take a single input\n");
+        return 1;
+    }
+    // the baseline and every clone must run on any CPU of their level, which
+    // a TargetMachine tuned by --mcpu/--mattr would not guarantee
+    if (!opts.mv_levels.empty() && (!opts.cpu.empty() || !opts.features.empty())) {
+        std::fprintf(stderr, "Error: --multiversion cannot be combined with --mcpu or --mattr\n");
+        return 1;
+    }
+    
+    // the mod table (lexed in full when it is loaded) and the target are set
+    // up once and only read afterwards, so batch workers can share them
+    ModTable local_mods;
+    const ModTable* mods = &local_mods;
+    if (opts.modsdir) {
+        SmallString<256> real;
+        if (warm && !warm->mods_dir.empty() && !sys::fs::real_path(opts.modsdir, real) && real == warm->mods_dir) {
+            mods = &warm->mods;
+            DEBUG_LOG("using the server's mod table for %s\n", opts.modsdir);
+        } else {
+            load_mod_dir(opts.modsdir, local_mods, /*force=*/false);
+        }
+        DEBUG_LOG("load_mods returned %zu\n", mods->size());
+    }
+    timer.mark("mods");
     
+    if (opts.run_jit && target_triple) {
+        std::fprintf(stderr, "Warning: --target is ignored with --run, which runs on this machine\n");
+        target_triple = nullptr;
+    }
+    opts.triple = target_triple ? Triple::normalize(target_triple)
+                : opts.run_jit ? sys::getProcessTriple() : sys::getDefaultTargetTriple();
+    std::string Err;
+    opts.target = InitializeTargetFor(opts.triple, Err);
+    if (!opts.target) {
+        std::fprintf(stderr, "Error: %s\n", Err.c_str());
+        return 7;
+    }
+    
+    if (opts.lto_thin) {
+        if (!opts.mv_levels.empty() || opts.codegen_threads > 1)
+            std::fprintf(stderr, "Warning: --multiversion and --codegen-threads are ignored with --lto=thin (use -j)\n");
+        return compile_thin_lto(opts, inputs, outfile ? outfile : "", mods, jobs, timer);
+    }
+    if (inputs.size() > 1) return compile_batch(opts, inputs, mods, jobs);
+    return compile_file(opts, inputs[0].c_str(), outfile ? outfile : "", mods, warm, timer);
+}
+
+// ---------------------------------------------------------------------------
+// Compile server
+// --server 在本地 Unix socket 上常驻，LLVM 目标、TargetMachine 和 mods 表只初始化一次。
+// 每个请求 fork 一个子进程处理：子进程继承这些已初始化的状态，切换到客户端的工作目录，
+// 把客户端传来的 stdin/stdout/stderr 接到 0/1/2 上，然后按普通命令行编译。
+// 请求格式：u32 长度 + "cwd\0arg1\0arg2\0..."，三个文件描述符用 SCM_RIGHTS 附带；
+// 回复是 i32 退出码。
+// ---------------------------------------------------------------------------
+
+#ifndef _WIN32
+
+static bool write_all(int fd, const void* data, size_t n) {
+    const char* p = (const char*)data;
+    while (n > 0) {
+        ssize_t w = ::write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w;
+        n -= (size_t)w;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* data, size_t n) {
+    char* p = (char*)data;
+    while (n > 0) {
+        ssize_t r = ::read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r;
+        n -= (size_t)r;
+    }
+    return true;
+}
+
+static bool make_socket_addr(const char* path, sockaddr_un& addr) {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (std::strlen(path) >= sizeof(addr.sun_path)) {
+        std::fprintf(stderr, "Error: socket path is too long: %s\n", path);
+        return false;
+    }
+    std::strcpy(addr.sun_path, path);
+    return true;
+}
+
+// runs in the forked child; returns the child's exit status
+static int serve_request(int conn, WarmState& warm) {
+    uint32_t len = 0;
+    int fds[3] = {-1, -1, -1};
+    char control[CMSG_SPACE(sizeof(fds))];
+    iovec iov = {&len, sizeof(len)};
+    msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t r;
+    do r = ::recvmsg(conn, &msg, MSG_WAITALL); while (r < 0 && errno == EINTR);
+    if (r != (ssize_t)sizeof(len)) return 1;
+    for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof(fds)))
+            std::memcpy(fds, CMSG_DATA(c), sizeof(fds));
+    if (fds[0] < 0 || len == 0 || len > (1u << 20)) return 1;
+    std::vector<char> payload(len + 1, '\0');
+    if (!read_all(conn, payload.data(), len)) return 1;
+
+    std::vector<char*> args;
+    const char* cwd = payload.data();
+    args.push_back((char*)"xfawac_llvm");
+    for (size_t k = std::strlen(cwd) + 1; k < len; k += std::strlen(&payload[k]) + 1) args.push_back(&payload[k]);
+    args.push_back(nullptr);
+    if (::chdir(cwd) != 0) return 1;
+    for (int k = 0; k < 3; ++k) {
+        ::dup2(fds[k], k);
+        ::close(fds[k]);
+    }
+
+    int32_t rc = compile_main((int)args.size() - 1, args.data(), &warm);
+    std::fflush(nullptr);
+    write_all(conn, &rc, sizeof(rc));
     return 0;
 }
+
+static int run_server(const char* sock_path, int argc, char** argv) {
+    const char* modsdir = "mods";
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--mods-dir") == 0 && i + 1 < argc) modsdir = argv[++i];
+        else if (std::strcmp(argv[i], "--debug") == 0) g_debug = 1;
+    }
+
+    WarmState warm;
+    warm.triple = sys::getDefaultTargetTriple();
+    std::string Err;
+    if (const Target* T = InitializeTargetFor(warm.triple, Err)) {
+        TargetOptions opt;
+        warm.tm.reset(T->createTargetMachine(warm.triple, "", "", opt, Reloc::PIC_));
+    }
+    SmallString<256> real;
+    if (!sys::fs::real_path(modsdir, real) && sys::fs::is_directory(real)) {
+        warm.mods_dir = std::string(real.str());
+        load_mod_dir(warm.mods_dir, warm.mods, /*force=*/false);
+    }
+
+    sockaddr_un addr;
+    if (!make_socket_addr(sock_path, addr)) return 1;
+    int lfd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0) {
+        std::fprintf(stderr, "Error: socket: %s\n", std::strerror(errno));
+        return 1;
+    }
+    ::unlink(sock_path);
+    if (::bind(lfd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(lfd, 128) != 0) {
+        std::fprintf(stderr, "Error: cannot listen on %s: %s\n", sock_path, std::strerror(errno));
+        ::close(lfd);
+        return 1;
+    }
+    // request children are never waited for
+    ::signal(SIGCHLD, SIG_IGN);
+    std::fprintf(stderr, "xfawac_llvm %s: serving on %s (%zu mod rule(s) loaded)\n", VERSION, sock_path, warm.mods.size());
+
+    while (true) {
+        int conn = ::accept(lfd, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            std::fprintf(stderr, "Error: accept: %s\n", std::strerror(errno));
+            break;
+        }
+        // refresh the warm mod table here so the next children inherit it
+        if (!warm.mods_dir.empty() && !mod_pack_is_current(warm.mods, warm.mods_dir)) {
+            DEBUG_LOG("server: reloading mods from %s\n", warm.mods_dir.c_str());
+            warm.mods = ModTable();
+            load_mod_dir(warm.mods_dir, warm.mods, /*force=*/false);
+        }
+        pid_t pid = ::fork();
+        if (pid == 0) {
+            // the compile waits for its own linker, which SIG_IGN would auto-reap
+            ::signal(SIGCHLD, SIG_DFL);
+            ::close(lfd);
+            ::_exit(serve_request(conn, warm));
+        }
+        if (pid < 0) std::fprintf(stderr, "Error: fork: %s\n", std::strerror(errno));
+        ::close(conn);
+    }
+    ::close(lfd);
+    return 1;
+}
+
+// Forwards a compile to a server. Returns -1 if no server is listening, so the
+// caller can compile in-process instead.
+static int run_client(const char* sock_path, int argc, char** argv) {
+    sockaddr_un addr;
+    if (!make_socket_addr(sock_path, addr)) return -1;
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (::connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    SmallString<256> cwd;
+    sys::fs::current_path(cwd);
+    std::string payload(cwd.str());
+    payload += '\0';
+    for (int i = 1; i < argc; ++i) {
+        payload += argv[i];
+        payload += '\0';
+    }
+    uint32_t len = (uint32_t)payload.size();
+    int fds[3] = {0, 1, 2};
+    char control[CMSG_SPACE(sizeof(fds))];
+    std::memset(control, 0, sizeof(control));
+    iovec iov = {&len, sizeof(len)};
+    msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(c), fds, sizeof(fds));
+    std::fflush(nullptr);
+    int32_t rc = 0;
+    if (::sendmsg(fd, &msg, 0) != (ssize_t)sizeof(len) || !write_all(fd, payload.data(), payload.size()) ||
+        !read_all(fd, &rc, sizeof(rc))) {
+        std::fprintf(stderr, "Error: lost the connection to the compile server at %s\n", sock_path);
+        rc = 11;
+    }
+    ::close(fd);
+    return rc;
+}
+
+#endif // !_WIN32
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // --server and --connect are taken out before the compile arguments are parsed
+    const char* server_sock = nullptr;
+    const char* connect_sock = nullptr;
+    std::vector<char*> args;
+    for (int i = 0; i < argc; ++i) {
+        if (i > 0 && std::strcmp(argv[i], "--server") == 0 && i + 1 < argc) server_sock = argv[++i];
+        else if (i > 0 && std::strcmp(argv[i], "--connect") == 0 && i + 1 < argc) connect_sock = argv[++i];
+        else args.push_back(argv[i]);
+    }
+    int nargs = (int)args.size();
+    args.push_back(nullptr);
+
+#ifdef _WIN32
+    if (server_sock) {
+        std::fprintf(stderr, "Error: --server is not supported on Windows\n");
+        return 1;
+    }
+#else
+    if (server_sock) return run_server(server_sock, nargs, args.data());
+    if (connect_sock) {
+        int rc = run_client(connect_sock, nargs, args.data());
+        if (rc >= 0) return rc;
+        DEBUG_LOG("no compile server at %s, compiling in-process\n", connect_sock);
+    }
+#endif
+    if (nargs < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    return compile_main(nargs, args.data(), nullptr);
+}
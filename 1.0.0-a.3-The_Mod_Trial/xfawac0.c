@@ -11,6 +11,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <errno.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -21,27 +22,37 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <dirent.h>
 #define GET_PID() getpid()
 #endif
 
-#define MAX_CODE_SIZE 65536
-#define MAX_RANGE_ELEMENTS 4096
 #define VERSION "1.0.0-a.3"
 
 /* Global flags for controlling behavior */
 static int g_debug = 0;
 static int g_keep_temp = 0;
+/* --stdout-buffering: NULL = printf + fflush per print (default), else the
+   _IONBF/_IOLBF/_IOFBF mode handed to setvbuf in the generated main */
+static const char* g_stdout_buffering = NULL;
+/* --seed: fixed seed for random[...] (else XF_SEED or the clock at run time) */
+static int g_has_seed = 0;
+static unsigned long long g_seed = 0;
 
 /* Debug logging macro */
 #define DEBUG_LOG(...) do { if (g_debug) fprintf(stderr, "[debug] " __VA_ARGS__); } while(0)
 
+/* Read a whole file ("-" is stdin) into a NUL-terminated malloc'ed buffer.
+   There is no size limit; pipes are read in growing chunks. */
 static char* read_file_safely(const char* path) {
-    FILE* f = fopen(path, "rb"); if (!f) return NULL;
-    fseek(f,0,SEEK_END); long sz = ftell(f); fseek(f,0,SEEK_SET);
-    if (sz <= 0 || sz > MAX_CODE_SIZE) { fclose(f); return NULL; }
-    char* buf = malloc((size_t)sz + 1); if (!buf) { fclose(f); return NULL; }
-    if (fread(buf,1,(size_t)sz,f) != (size_t)sz) { free(buf); fclose(f); return NULL; }
-    buf[sz]='\0'; fclose(f); return buf;
+    FILE* f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb"); if (!f) return NULL;
+    size_t cap = 65536, len = 0, n; char* buf = malloc(cap + 1); if (!buf) { if (f != stdin) fclose(f); return NULL; }
+    while ((n = fread(buf + len, 1, cap - len, f)) > 0) {
+        len += n;
+        if (len == cap) { char* nb = realloc(buf, cap * 2 + 1); if (!nb) { free(buf); if (f != stdin) fclose(f); return NULL; } buf = nb; cap *= 2; }
+    }
+    if (f != stdin) fclose(f);
+    if (len == 0) { free(buf); return NULL; }
+    buf[len]='\0'; return buf;
 }
 
 /* Check whether a byte buffer is valid UTF-8 */
@@ -126,8 +137,71 @@ static char* escape_bytes_as_c_string(const char* in) {
     out[oi] = '\0'; return out;
 }
 
-/* Very small mod map loader: reads all mods/*.xfmod and extracts "a" = "b" pairs */
-struct modmap { char from[128]; char to[128]; };
+/* Mod map loader: reads all mods/*.xfmod and extracts "a" = "b" pairs.
+   There is no limit on the number or length of pairs; lookups go through an
+   open-addressing hash index so apply_mods costs one probe per identifier. */
+struct modmap { char* from; size_t flen; char* to; size_t tlen; };
+struct modtable { struct modmap* maps; int count, cap; int* slots; size_t nslots; };
+
+static size_t mod_hash(const char* s, size_t n) {
+    size_t h = 2166136261u; for (size_t i = 0; i < n; i++) { h ^= (unsigned char)s[i]; h *= 16777619u; } return h;
+}
+
+static char* mod_strndup(const char* s, size_t n) {
+    char* r = malloc(n + 1); if (!r) return NULL; memcpy(r, s, n); r[n] = '\0'; return r;
+}
+
+/* returns the index of `from` or -1 */
+static int mod_find(const struct modtable* t, const char* s, size_t n) {
+    if (!t->nslots) return -1;
+    for (size_t i = mod_hash(s, n) & (t->nslots - 1);; i = (i + 1) & (t->nslots - 1)) {
+        int m = t->slots[i]; if (m < 0) return -1;
+        if (t->maps[m].flen == n && memcmp(t->maps[m].from, s, n) == 0) return m;
+    }
+}
+
+static void mod_rehash(struct modtable* t, size_t nslots) {
+    int* slots = malloc(nslots * sizeof(int)); if (!slots) return;
+    for (size_t i = 0; i < nslots; i++) slots[i] = -1;
+    for (int m = 0; m < t->count; m++) {
+        size_t i = mod_hash(t->maps[m].from, t->maps[m].flen) & (nslots - 1);
+        while (slots[i] >= 0) i = (i + 1) & (nslots - 1);
+        slots[i] = m;
+    }
+    free(t->slots); t->slots = slots; t->nslots = nslots;
+}
+
+/* the first definition of an alias wins, as it did with the linear scan */
+static void mod_add(struct modtable* t, const char* a, size_t alen, const char* b, size_t blen) {
+    if (mod_find(t, a, alen) >= 0) { DEBUG_LOG("load_mods: duplicate alias '%.*s' ignored\n", (int)alen, a); return; }
+    if (t->count == t->cap) {
+        int ncap = t->cap ? t->cap * 2 : 64; struct modmap* nm = realloc(t->maps, (size_t)ncap * sizeof(*nm)); if (!nm) return;
+        t->maps = nm; t->cap = ncap;
+    }
+    struct modmap* m = &t->maps[t->count];
+    m->from = mod_strndup(a, alen); m->to = mod_strndup(b, blen); if (!m->from || !m->to) { free(m->from); free(m->to); return; }
+    m->flen = alen; m->tlen = blen; t->count++;
+    if ((size_t)t->count * 2 > t->nslots) mod_rehash(t, t->nslots ? t->nslots * 2 : 128);
+    else { size_t i = mod_hash(a, alen) & (t->nslots - 1); while (t->slots[i] >= 0) i = (i + 1) & (t->nslots - 1); t->slots[i] = t->count - 1; }
+}
+
+static void free_mods(struct modtable* t) {
+    for (int m = 0; m < t->count; m++) { free(t->maps[m].from); free(t->maps[m].to); }
+    free(t->maps); free(t->slots); memset(t, 0, sizeof(*t));
+}
+
+static void parse_mod_pairs(const char* buf, struct modtable* t) {
+    const char* p = buf;
+    while (*p) {
+        /* find lhs quoted string */
+        while (*p && *p != '"') p++; if (!*p) break; const char* a = p+1; const char* q = strchr(a, '"'); if (!q) break; size_t llen = (size_t)(q - a); p = q+1;
+        DEBUG_LOG("load_mods: found lhs='%.*s'\n", (int)llen, a);
+        /* find '=' */ while (*p && *p != '=') p++; if (!*p) break; p++;
+        /* find rhs quoted string */ while (*p && *p != '"') p++; if (!*p) break; const char* b = p+1; q = strchr(b, '"'); if (!q) break; size_t rlen = (size_t)(q - b); p = q+1;
+        DEBUG_LOG("load_mods: found rhs='%.*s'\n", (int)rlen, b);
+        mod_add(t, a, llen, b, rlen);
+    }
+}
 
 #ifdef _WIN32
 #include <io.h>
@@ -144,57 +218,39 @@ struct modmap { char from[128]; char to[128]; };
 #include <sys/stat.h>
 #endif
 
-static int load_mods(const char* dir, struct modmap* maps, int maxmaps) {
+static void load_mod_file(const char* path, struct modtable* t) {
+    DEBUG_LOG("load_mods: reading %s\n", path);
+    char* buf = read_file_safely(path); if (!buf) { DEBUG_LOG("load_mods: read_file_safely returned NULL for %s\n", path); return; }
+    DEBUG_LOG("load_mods: buf[0..80]=%.80s\n", buf);
+    parse_mod_pairs(buf, t);
+    free(buf);
+}
+
+static int load_mods(const char* dir, struct modtable* t) {
 #ifdef _WIN32
     char pattern[1024]; snprintf(pattern,sizeof(pattern), "%s\\*.xfmod", dir);
-    struct _finddata_t fd; long h = _findfirst(pattern,&fd); if (h == -1) return 0;
-    int count = 0;
+    struct _finddata_t fd; intptr_t h = _findfirst(pattern,&fd); if (h == -1) return 0;
     do {
         char path[1024]; snprintf(path,sizeof(path), "%s\\%s", dir, fd.name);
-        DEBUG_LOG("load_mods: reading %s\n", path);
-        char* buf = read_file_safely(path); if (!buf) { DEBUG_LOG("load_mods: read_file_safely returned NULL for %s\n", path); continue; }
-        DEBUG_LOG("load_mods: buf[0..80]=%.80s\n", buf);
-        char* p = buf;
-        while (*p) {
-            /* find lhs quoted string */
-            while (*p && *p != '"') p++; if (!*p) break; char* a = p+1; char* q = strchr(a, '"'); if (!q) break; size_t llen = (size_t)(q - a); if (llen >= 127) llen = 127; char lhs[128]; memcpy(lhs, a, llen); lhs[llen]= '\0'; p = q+1;
-                DEBUG_LOG("load_mods: found lhs='%s'\n", lhs);
-            /* find '=' */ while (*p && *p != '=') p++; if (!*p) break; p++;
-            /* find rhs quoted string */ while (*p && *p != '"') p++; if (!*p) break; char* b = p+1; q = strchr(b, '"'); if (!q) break; size_t rlen = (size_t)(q - b); if (rlen >= 127) rlen = 127; char rhs[128]; memcpy(rhs, b, rlen); rhs[rlen] = '\0'; p = q+1;
-                DEBUG_LOG("load_mods: found rhs='%s'\n", rhs);
-            if (count < maxmaps) { strncpy(maps[count].from,lhs,sizeof(maps[count].from)-1); maps[count].from[sizeof(maps[count].from)-1]='\0'; strncpy(maps[count].to,rhs,sizeof(maps[count].to)-1); maps[count].to[sizeof(maps[count].to)-1]='\0'; count++; }
-        }
-        free(buf);
+        load_mod_file(path, t);
     } while (_findnext(h,&fd) == 0);
     _findclose(h);
-    return count;
 #else
-    DIR* d = opendir(dir); if (!d) return 0; struct dirent* e; int count=0;
+    DIR* d = opendir(dir); if (!d) return 0; struct dirent* e;
     while ((e = readdir(d))!=NULL) {
         const char* name = e->d_name; size_t ln = strlen(name);
         if (ln > 6 && strcmp(name+ln-6, ".xfmod")==0) {
             char path[1024]; snprintf(path,sizeof(path), "%s/%s", dir, name);
-            DEBUG_LOG("load_mods: reading %s\n", path);
-            char* buf = read_file_safely(path); if (!buf) { DEBUG_LOG("load_mods: read_file_safely returned NULL for %s\n", path); continue; }
-            DEBUG_LOG("load_mods: buf[0..80]=%.80s\n", buf);
-            char* p = buf;
-            while (*p) {
-                /* find lhs quoted string */
-                while (*p && *p != '"') p++; if (!*p) break; char* a = p+1; char* q = strchr(a, '"'); if (!q) break; size_t llen = (size_t)(q - a); if (llen >= 127) llen = 127; char lhs[128]; memcpy(lhs, a, llen); lhs[llen]= '\0'; p = q+1;
-                /* find '=' */ while (*p && *p != '=') p++; if (!*p) break; p++;
-                /* find rhs quoted string */ while (*p && *p != '"') p++; if (!*p) break; char* b = p+1; q = strchr(b, '"'); if (!q) break; size_t rlen = (size_t)(q - b); if (rlen >= 127) rlen = 127; char rhs[128]; memcpy(rhs, b, rlen); rhs[rlen] = '\0'; p = q+1;
-                if (count < maxmaps) { strncpy(maps[count].from,lhs,sizeof(maps[count].from)-1); maps[count].from[sizeof(maps[count].from)-1]='\0'; strncpy(maps[count].to,rhs,sizeof(maps[count].to)-1); maps[count].to[sizeof(maps[count].to)-1]='\0'; count++; }
-            }
-            free(buf);
+            load_mod_file(path, t);
         }
     }
     closedir(d);
-    return count;
 #endif
+    return t->count;
 }
 
-static char* apply_mods(const char* src, struct modmap* maps, int mcount) {
-    if (!mcount) return strdup(src);
+static char* apply_mods(const char* src, const struct modtable* t) {
+    if (!t->count) return strdup(src);
     size_t cap = strlen(src) + 1024; char* out = malloc(cap); if (!out) return NULL; out[0]='\0'; size_t outlen=0;
     const char* p = src;
     while (*p) {
@@ -205,12 +261,10 @@ static char* apply_mods(const char* src, struct modmap* maps, int mcount) {
         }
         if (isalpha((unsigned char)*p) || *p=='_') {
             const char* s = p; while (isalnum((unsigned char)*p) || *p=='_') p++; size_t tl = (size_t)(p-s);
-            char tok[256]; if (tl >= sizeof(tok)) tl = sizeof(tok)-1; memcpy(tok, s, tl); tok[tl]='\0'; int rep=0;
-            for (int i=0;i<mcount;i++) if (strcmp(tok, maps[i].from)==0) {
-                size_t rlen = strlen(maps[i].to); if (outlen + rlen + 1 > cap) { cap = (cap + rlen + 1)*2; out=realloc(out,cap); }
-                memcpy(out+outlen, maps[i].to, rlen); outlen += rlen; out[outlen]='\0'; rep=1; break;
-            }
-            if (!rep) { if (outlen + tl + 1 > cap) { cap = (cap + tl + 1)*2; out=realloc(out,cap); } memcpy(out+outlen,tok,tl); outlen += tl; out[outlen]='\0'; }
+            int m = mod_find(t, s, tl);
+            const char* r = m >= 0 ? t->maps[m].to : s; size_t rlen = m >= 0 ? t->maps[m].tlen : tl;
+            if (outlen + rlen + 1 > cap) { cap = (cap + rlen + 1)*2; out=realloc(out,cap); }
+            memcpy(out+outlen, r, rlen); outlen += rlen; out[outlen]='\0';
             continue;
         }
         if (outlen + 2 > cap) { cap *=2; out = realloc(out, cap); }
@@ -241,29 +295,86 @@ static void write_preamble(FILE* out, int need_time) {
     fprintf(out, "    }\n");
     fprintf(out, "    SetConsoleOutputCP(prev);\n");
     fprintf(out, "#else\n");
-    fprintf(out, "    if (s) { printf(\"%%s\\n\", s); fflush(stdout); }\n");
+    if (g_stdout_buffering) fprintf(out, "    if (s) { fputs(s, stdout); putchar('\\n'); }\n");
+    else fprintf(out, "    if (s) { printf(\"%%s\\n\", s); fflush(stdout); }\n");
     fprintf(out, "#endif\n");
     fprintf(out, "}\n\n");
+    if (g_stdout_buffering) fprintf(out, "static char xf_stdout_buf[65536];\n\n");
+    if (need_time) {
+        /* random[...] runtime: xoshiro256** seeded through splitmix64 on first
+           use, Lemire's unbiased bounded sampling; one state per thread */
+        fprintf(out, "static _Thread_local unsigned long long xf_rng_s[4];\n");
+        fprintf(out, "static void xf_rng_seed(void) {\n");
+        if (g_has_seed) fprintf(out, "    unsigned long long x = %lluULL;\n", g_seed);
+        else {
+            fprintf(out, "    const char* e = getenv(\"XF_SEED\");\n");
+            fprintf(out, "    unsigned long long x = e ? strtoull(e, NULL, 0) : (unsigned long long)time(NULL);\n");
+        }
+        fprintf(out, "    for (int k = 0; k < 4; k++) {\n");
+        fprintf(out, "        unsigned long long z = (x += 0x9e3779b97f4a7c15ULL);\n");
+        fprintf(out, "        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;\n");
+        fprintf(out, "        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;\n");
+        fprintf(out, "        xf_rng_s[k] = z ^ (z >> 31);\n");
+        fprintf(out, "    }\n");
+        fprintf(out, "}\n");
+        fprintf(out, "static unsigned long long xf_rng_rotl(unsigned long long x, int k) { return (x << k) | (x >> (64 - k)); }\n");
+        fprintf(out, "static unsigned long long xf_rng_next(void) {\n");
+        fprintf(out, "    unsigned long long* s = xf_rng_s;\n");
+        fprintf(out, "    if (!(s[0] | s[1] | s[2] | s[3])) xf_rng_seed();\n");
+        fprintf(out, "    unsigned long long r = xf_rng_rotl(s[1] * 5, 7) * 9, t = s[1] << 17;\n");
+        fprintf(out, "    s[2] ^= s[0]; s[3] ^= s[1]; s[1] ^= s[2]; s[0] ^= s[3]; s[2] ^= t; s[3] = xf_rng_rotl(s[3], 45);\n");
+        fprintf(out, "    return r;\n");
+        fprintf(out, "}\n");
+        fprintf(out, "static long long xf_random(long long lo, unsigned long long span) {\n");
+        fprintf(out, "    if (!span) return (long long)((unsigned long long)lo + xf_rng_next());\n");
+        fprintf(out, "    unsigned __int128 m = (unsigned __int128)xf_rng_next() * span;\n");
+        fprintf(out, "    if ((unsigned long long)m < span) {\n");
+        fprintf(out, "        unsigned long long t = -span %% span;\n");
+        fprintf(out, "        while ((unsigned long long)m < t) m = (unsigned __int128)xf_rng_next() * span;\n");
+        fprintf(out, "    }\n");
+        fprintf(out, "    return (long long)((unsigned long long)lo + (unsigned long long)(m >> 64));\n");
+        fprintf(out, "}\n\n");
+    }
     fprintf(out, "int main(void) {\n");
-    if (need_time) fprintf(out, "    srand((unsigned)time(NULL));\n");
+    /* stdio flushes the buffer when it fills and when main returns */
+    if (g_stdout_buffering) fprintf(out, "    setvbuf(stdout, xf_stdout_buf, %s, sizeof(xf_stdout_buf));\n", g_stdout_buffering);
 }
 
 /* helper to trim */
 static char* trimcpy(const char* s, size_t n) { while (n>0 && isspace((unsigned char)s[n-1])) n--; size_t a=0; while (a<n && isspace((unsigned char)s[a])) a++; size_t len = (a>n)?0:(n-a); char* r = malloc(len+1); memcpy(r, s+a, len); r[len]='\0'; return r; }
 
-/* parse generator content like 1...20 or 1...20:2, fill start,end,step, return 1 on ok */
-static int parse_range(const char* s, int* out_start, int* out_end, int* out_step) {
-    // s expected like 1...20 or 1...20:2
-    const char* p = s; while (*p && isspace((unsigned char)*p)) p++;
-    char* dots = strstr(p, "..."); if (!dots) return 0;
-    char left[64], right[64]; int l=0; const char* q = p; while (q < dots && l+1 < (int)sizeof(left)) left[l++] = *q++; left[l]='\0';
-    q = dots + 3; int r=0; while (*q && *q != ':' && r+1 < (int)sizeof(right)) right[r++] = *q++; right[r]='\0';
-    int step = 1; if (*q == ':') { q++; step = atoi(q); if (step <= 0) return 0; }
-    int a = atoi(left); int b = atoi(right);
-    if (b < a) return 0;
-    long cnt = (long)((b - a) / step) + 1;
-    if (cnt <= 0 || cnt > MAX_RANGE_ELEMENTS) return -1; // too big
-    *out_start = a; *out_end = b; *out_step = step; return 1;
+/* parse generator content like 1...20, 20...1 or 1...20:-2 into a walk from
+   first towards last by a non-zero step (64-bit, ranges are never
+   materialized). Without a step it counts towards the other end. `reverse`
+   (rcp) walks from b back to a: rcp[a...b:s] is seq[b...a:-s]. Returns 1 on
+   ok, 0 on bad syntax or a step pointing away from last. */
+static int parse_range(const char* s, int reverse, long long* out_first, long long* out_last, long long* out_step) {
+    char* q; errno = 0;
+    long long a = strtoll(s, &q, 10); if (q == s) return 0;
+    while (isspace((unsigned char)*q)) q++;
+    if (strncmp(q, "...", 3) != 0) return 0;
+    const char* bs = q + 3; long long b = strtoll(bs, &q, 10); if (q == bs) return 0;
+    long long step = 0; int has_step = 0;
+    while (isspace((unsigned char)*q)) q++;
+    if (*q == ':') { const char* ss = q + 1; step = strtoll(ss, &q, 10); if (q == ss) return 0; has_step = 1; }
+    while (isspace((unsigned char)*q)) q++;
+    if (*q || errno) return 0;
+    if (reverse) { long long t = a; a = b; b = t; step = (long long)(0 - (unsigned long long)step); }
+    if (!has_step) step = a <= b ? 1 : -1;
+    if (step > 0 ? a > b : (step == 0 || a < b)) return 0;
+    *out_first = a; *out_last = b; *out_step = step; return 1;
+}
+
+/* find the start of a // comment in [s, e), skipping "//" inside string literals.
+   Only the current line is scanned; returns e when there is no comment. */
+static const char* find_line_comment(const char* s, const char* e) {
+    int in_str = 0;
+    for (const char* c = s; c + 1 < e; c++) {
+        if (in_str) { if (*c == '\\') c++; else if (*c == '"') in_str = 0; }
+        else if (*c == '"') in_str = 1;
+        else if (c[0] == '/' && c[1] == '/') return c;
+    }
+    return e;
 }
 
 /* generate a valid C identifier for block+fn */
@@ -272,12 +383,37 @@ static void make_fn_name(const char* block, const char* fn, char* out, size_t ou
     for (size_t i=0;i<strlen(out);i++) if (!isalnum((unsigned char)out[i]) && out[i] != '_') out[i] = '_';
 }
 
+/* growable buffer for the emitted function bodies (no fixed size limit) */
+static char* functions = NULL; static size_t flen = 0, fcap = 0;
+static void fn_append(const char* s, size_t n) {
+    if (flen + n + 1 > fcap) {
+        size_t nc = fcap ? fcap : 65536; while (flen + n + 1 > nc) nc *= 2;
+        char* nb = realloc(functions, nc); if (!nb) { fprintf(stderr, "Out of memory\n"); exit(1); }
+        functions = nb; fcap = nc;
+    }
+    memcpy(functions + flen, s, n); flen += n; functions[flen] = '\0';
+}
+
+/* print_utf8 call for an escaped literal. A print that directly follows
+   another one is folded into it ("a" then "b" becomes "a\nb"), so a run of
+   prints costs one printf/fflush instead of one per line. */
+static size_t last_print_end = (size_t)-1;
+static void fn_append_print(const char* esc) {
+    static const char head[] = "    print_utf8(\"", tail[] = "\");\n";
+    if (flen == last_print_end) { flen -= sizeof(tail) - 1; fn_append("\\n", 2); }
+    else fn_append(head, sizeof(head) - 1);
+    fn_append(esc, strlen(esc));
+    fn_append(tail, sizeof(tail) - 1);
+    last_print_end = flen;
+}
+
 /* main simple translator: parse top-level blocks and emit C */
 static int parse_and_emit(const char* code, const char* tmpc, const char* modsdir) {
-    struct modmap maps[128]; int mcount=0; char* moded = NULL;
-    if (modsdir) mcount = load_mods(modsdir, maps, 128);
+    struct modtable mods = {0}; int mcount=0; char* moded = NULL;
+    if (modsdir) mcount = load_mods(modsdir, &mods);
     DEBUG_LOG("load_mods returned %d\n", mcount);
-    if (mcount) moded = apply_mods(code, maps, mcount);
+    if (mcount) moded = apply_mods(code, &mods);
+    free_mods(&mods);
     if (moded) DEBUG_LOG("mods applied, moded len=%zu\n", strlen(moded));
     const char* src = moded ? moded : code;
         DEBUG_LOG("parse_and_emit: src[0..160]=%.160s\n", src);
@@ -288,8 +424,7 @@ static int parse_and_emit(const char* code, const char* tmpc, const char* modsdi
     // find blocks
     const char* scan = src;
     // we'll collect function bodies and emit all functions then main
-    static char functions[65536]; functions[0]='\0'; size_t flen = 0;
-    static char main_body[65536]; main_body[0]='\0'; size_t mlen = 0;
+    flen = 0; last_print_end = (size_t)-1; fn_append("", 0);
     char entry_fn[256]; entry_fn[0] = '\0';
     while (1) {
         const char* ob = strchr(scan, '#'); if (!ob) break;
@@ -312,13 +447,9 @@ static int parse_and_emit(const char* code, const char* tmpc, const char* modsdi
             const char* s = line; while (s < le && isspace((unsigned char)*s)) s++;
             const char* e = le; while (e > s && isspace((unsigned char)e[-1])) e--;
             
-            // Handle // comments - only if we have content
-            if (s < e) {
-                const char* comment_start = strstr(s, "//");
-                if (comment_start && comment_start < e) {
-                    e = comment_start;
-                }
-            }
+            // Handle // comments - only within this line
+            e = find_line_comment(s, e);
+            while (e > s && isspace((unsigned char)e[-1])) e--;
             
 
             
@@ -343,7 +474,7 @@ static int parse_and_emit(const char* code, const char* tmpc, const char* modsdi
                         strncpy(entry_fn, fname, sizeof(entry_fn)-1);
                     }
                     // start function
-                    char buf[8192]; snprintf(buf, sizeof(buf), "void %s(void) {\n", fname); size_t bl = strlen(buf); if (flen + bl + 1 < sizeof(functions)) { memcpy(functions+flen, buf, bl); flen += bl; functions[flen]='\0'; }
+                    char buf[8192]; snprintf(buf, sizeof(buf), "void %s(void) {\n", fname); size_t bl = strlen(buf); fn_append(buf, bl);
                     // parse body lines
                     const char* L = bodystart;
                     while (L < bodyend) {
@@ -351,24 +482,23 @@ static int parse_and_emit(const char* code, const char* tmpc, const char* modsdi
                         const char* ss = L; while (ss < NL && isspace((unsigned char)*ss)) ss++;
                         const char* ee = NL; while (ee > ss && isspace((unsigned char)ee[-1])) ee--;
                         
-                        // Handle // comments - only if we have content
-                        if (ss < ee) {
-                            const char* comment_start = strstr(ss, "//");
-                            if (comment_start && comment_start < ee) {
-                                ee = comment_start;
-                            }
-                        }
+                        // Handle // comments - only within this line
+                        ee = find_line_comment(ss, ee);
+                        while (ee > ss && isspace((unsigned char)ee[-1])) ee--;
                         
 
                         
                         size_t lon = (size_t)(ee - ss);
                         if (lon > 0) {
+                            // only a print directly after a print is folded; any other
+                            // line (even a lone '}' that emits nothing) ends the run
+                            if (!(lon >= 6 && strncmp(ss, "print(", 6) == 0)) last_print_end = (size_t)-1;
                             // $block@fn call
                             if (ss[0] == '$') {
                                 const char* at = memchr(ss, '@', lon);
                                 if (at) {
                                     size_t bnl = (size_t)(at - (ss+1)); char bname[128]; if (bnl >= sizeof(bname)) bnl = sizeof(bname)-1; memcpy(bname, ss+1, bnl); bname[bnl]='\0';
-                                    size_t fnl2 = (size_t)(ee - at - 1); if (fnl2 >= sizeof(bname)) fnl2 = sizeof(bname)-1; char f2[128]; memcpy(f2, at+1, fnl2); f2[fnl2]='\0'; char calln[256]; make_fn_name(bname, f2, calln, sizeof(calln)); char cb[512]; snprintf(cb, sizeof(cb), "    %s();\n", calln); size_t cbk = strlen(cb); if (flen + cbk +1 < sizeof(functions)) { memcpy(functions+flen, cb, cbk); flen += cbk; functions[flen]='\0'; }
+                                    size_t fnl2 = (size_t)(ee - at - 1); if (fnl2 >= sizeof(bname)) fnl2 = sizeof(bname)-1; char f2[128]; memcpy(f2, at+1, fnl2); f2[fnl2]='\0'; char calln[256]; make_fn_name(bname, f2, calln, sizeof(calln)); char cb[512]; snprintf(cb, sizeof(cb), "    %s();\n", calln); size_t cbk = strlen(cb); fn_append(cb, cbk);
                                 }
                             } else if (lon >= 6 && strncmp(ss, "print(",6)==0) {
                                 // extract between quotes (support ascii)
@@ -381,9 +511,7 @@ static int parse_and_emit(const char* code, const char* tmpc, const char* modsdi
                                             memcpy(lit, qs+1, ql); lit[ql]='\0';
                                             char* esc = escape_bytes_as_c_string(lit);
                                             if (esc) {
-                                                char outln[2048]; snprintf(outln, sizeof(outln), "    print_utf8(\"%s\");\n", esc);
-                                                size_t obl=strlen(outln);
-                                                if (flen + obl +1 < sizeof(functions)) { memcpy(functions+flen,outln,obl); flen += obl; functions[flen]='\0'; }
+                                                fn_append_print(esc);
                                                 free(esc);
                                             }
                                             free(lit);
@@ -400,39 +528,35 @@ static int parse_and_emit(const char* code, const char* tmpc, const char* modsdi
                                 // detect generators
                                 if (strncmp(val, "random[",7)==0 || strncmp(val, "rnd[",4)==0) {
                                     const char* br = strchr(val,'['); if (br) {
-                                        const char* inside = br+1; char tmp[128]; strncpy(tmp, inside, sizeof(tmp)-1); tmp[sizeof(tmp)-1]='\0'; char* rb = strchr(tmp,']'); if (rb) *rb='\0'; int a,b,step; char inner[128]; strncpy(inner,tmp,sizeof(inner)-1); inner[sizeof(inner)-1]='\0'; int pr = parse_range(inner,&a,&b,&step);
-                                    if (pr == -1) {
-                                        DEBUG_LOG("Range too large for %s.%s\n", blockname, ident);
-                                        fprintf(stderr, "Error: Range too large for %s.%s (max %d elements)\n", blockname, ident, MAX_RANGE_ELEMENTS); free(val); L = NL+1; continue;
+                                        const char* inside = br+1; char tmp[128]; strncpy(tmp, inside, sizeof(tmp)-1); tmp[sizeof(tmp)-1]='\0'; char* rb = strchr(tmp,']'); if (rb) *rb='\0'; long long a,b,step; char inner[128]; strncpy(inner,tmp,sizeof(inner)-1); inner[sizeof(inner)-1]='\0'; int pr = parse_range(inner,0,&a,&b,&step);
+                                    if (!pr || a > b) {
+                                        DEBUG_LOG("Invalid range syntax for %s.%s\n", blockname, ident);
+                                        fprintf(stderr, "Error: Invalid range syntax for %s.%s\n", blockname, ident); free(val); L = NL+1; continue;
                                     }
                                     need_time = 1;
-                                    char linebuf[512]; snprintf(linebuf,sizeof(linebuf), "    int %s = (rand() % (%d - %d + 1)) + %d;\n", ident, b, a, a);
-                                    size_t lb = strlen(linebuf); if (flen + lb +1 < sizeof(functions)) { memcpy(functions+flen,linebuf,lb); flen += lb; functions[flen]='\0'; }
+                                    /* the span wraps to 0 for the full 64-bit range */
+                                    char linebuf[512]; snprintf(linebuf,sizeof(linebuf), "    long long %s = xf_random((long long)%lluULL, %lluULL);\n", ident, (unsigned long long)a, (unsigned long long)b - (unsigned long long)a + 1);
+                                    size_t lb = strlen(linebuf); fn_append(linebuf, lb);
                                     }
                                 } else if (strncmp(val, "sequential[",11)==0 || strncmp(val, "seq[",4)==0 || strncmp(val, "reciprocal[",11)==0 || strncmp(val, "rcp[",4)==0) {
-                                    const char* br = strchr(val,'['); if (!br) { free(val); L = NL+1; continue; } const char* ins = br+1; char tmp2[128]; strncpy(tmp2, ins, sizeof(tmp2)-1); tmp2[sizeof(tmp2)-1]='\0'; char* rc = strchr(tmp2,']'); if (rc) *rc='\0'; int a,b,step; int pr = parse_range(tmp2,&a,&b,&step);
-                                    if (pr == -1) { 
-                                        DEBUG_LOG("Range too large for %s.%s\n", blockname, ident);
-                                        fprintf(stderr, "Error: Range too large for %s.%s (max %d elements)\n", blockname, ident, MAX_RANGE_ELEMENTS); 
-                                        free(val); L = NL+1; continue; 
-                                    }
+                                    const char* br = strchr(val,'['); if (!br) { free(val); L = NL+1; continue; } const char* ins = br+1; char tmp2[128]; strncpy(tmp2, ins, sizeof(tmp2)-1); tmp2[sizeof(tmp2)-1]='\0'; char* rc = strchr(tmp2,']'); if (rc) *rc='\0'; int rev = strncmp(val, "reciprocal",10)==0 || strncmp(val, "rcp",3)==0; long long a,b,step; int pr = parse_range(tmp2,rev,&a,&b,&step);
                                     if (pr == 0) { 
                                         DEBUG_LOG("Invalid range syntax for %s.%s\n", blockname, ident);
                                         fprintf(stderr, "Error: Invalid range syntax for %s.%s\n", blockname, ident); 
                                         free(val); L = NL+1; continue; 
                                     }
-                                    // generate static idx and value
-                                    char idxname[128]; snprintf(idxname,sizeof(idxname),"__seq_%s_idx", ident);
-                                    char l1[256]; if (strncmp(val, "reciprocal",10)==0 || strncmp(val, "rcp",3)==0) {
-                                        snprintf(l1,sizeof(l1),"    static int %s = 0; int %s = %d - (%s++ * %d); if (%s < %d) %s = 0;\n", idxname, ident, b, idxname, step, ident, a, idxname);
-                                    } else {
-                                        snprintf(l1,sizeof(l1),"    static int %s = 0; int %s = %d + (%s++ * %d); if (%s > %d) %s = 0;\n", idxname, ident, a, idxname, step, ident, b, idxname);
-                                    }
-                                    size_t l1s=strlen(l1); if (flen + l1s +1 < sizeof(functions)) { memcpy(functions+flen,l1,l1s); flen += l1s; functions[flen]='\0'; }
+                                    // the static holds the value handed out next; it starts over
+                                    // once less than one step is left before the last value
+                                    char nextname[160]; snprintf(nextname,sizeof(nextname),"__seq_%s_next", ident);
+                                    unsigned long long ua = (unsigned long long)a, ub = (unsigned long long)b, stride = step > 0 ? (unsigned long long)step : 0 - (unsigned long long)step;
+                                    char left[256]; if (step > 0) snprintf(left,sizeof(left),"%lluULL - (unsigned long long)%s", ub, ident); else snprintf(left,sizeof(left),"(unsigned long long)%s - %lluULL", ident, ub);
+                                    /* three names, two idents, the remainder and five 64-bit numbers */
+                                    char l1[3 * sizeof(nextname) + 2 * sizeof(ident) + sizeof(left) + 256]; snprintf(l1,sizeof(l1),"    static long long %s = (long long)%lluULL; long long %s = %s; %s = %s < %lluULL ? (long long)%lluULL : %s + (long long)%lluULL;\n", nextname, ua, ident, nextname, nextname, left, stride, ua, ident, (unsigned long long)step);
+                                    size_t l1s=strlen(l1); fn_append(l1, l1s);
                                 } else {
                                     // default: copy as-is
                                     char linebuf[512]; snprintf(linebuf,sizeof(linebuf),"    int %s = %s;\n", ident, val);
-                                    size_t lb = strlen(linebuf); if (flen + lb +1 < sizeof(functions)) { memcpy(functions+flen,linebuf,lb); flen += lb; functions[flen]='\0'; }
+                                    size_t lb = strlen(linebuf); fn_append(linebuf, lb);
                                 }
                                 free(val);
                             } else if (lon >= 2 && strncmp(ss, "if",2)==0 && isspace((unsigned char)ss[2])) {
@@ -440,19 +564,19 @@ static int parse_and_emit(const char* code, const char* tmpc, const char* modsdi
                                 const char* bpos = memchr(ss, '{', lon);
                                 const char* conds = ss + 2; while (conds < (ss+lon) && isspace((unsigned char)*conds)) conds++;
                                 const char* cend = bpos; while (cend > conds && isspace((unsigned char)cend[-1])) cend--;
-                                char cond[256]; size_t cl = (size_t)(cend - conds); if (cl >= sizeof(cond)) cl = sizeof(cond)-1; memcpy(cond, conds, cl); cond[cl]='\0'; char outln[512]; snprintf(outln,sizeof(outln),"    if (%s) {\n", cond); size_t ol = strlen(outln); if (flen + ol +1 < sizeof(functions)) { memcpy(functions+flen,outln,ol); flen += ol; functions[flen]='\0'; }
+                                char cond[256]; size_t cl = (size_t)(cend - conds); if (cl >= sizeof(cond)) cl = sizeof(cond)-1; memcpy(cond, conds, cl); cond[cl]='\0'; char outln[512]; snprintf(outln,sizeof(outln),"    if (%s) {\n", cond); size_t ol = strlen(outln); fn_append(outln, ol);
                             } else if (lon >= 7 && strncmp(ss, "else if",7)==0) {
                                 const char* conds = ss + 7; while (conds < ee && isspace((unsigned char)*conds)) conds++;
                                 const char* bpos = memchr(conds, '{', (size_t)(ee-conds)); const char* cend = bpos; while (cend > conds && isspace((unsigned char)cend[-1])) cend--;
-                                char cond[256]; size_t cl = (size_t)(cend - conds); if (cl >= sizeof(cond)) cl = sizeof(cond)-1; memcpy(cond, conds, cl); cond[cl]='\0'; char outln[512]; snprintf(outln,sizeof(outln),"    else if (%s) {\n", cond); size_t ol = strlen(outln); if (flen + ol +1 < sizeof(functions)) { memcpy(functions+flen,outln,ol); flen += ol; functions[flen]='\0'; }
+                                char cond[256]; size_t cl = (size_t)(cend - conds); if (cl >= sizeof(cond)) cl = sizeof(cond)-1; memcpy(cond, conds, cl); cond[cl]='\0'; char outln[512]; snprintf(outln,sizeof(outln),"    else if (%s) {\n", cond); size_t ol = strlen(outln); fn_append(outln, ol);
                             } else if (lon >= 4 && strncmp(ss, "else",4)==0) {
-                                char outln[64]; snprintf(outln,sizeof(outln),"    else {\n"); size_t ol=strlen(outln); if (flen + ol +1 < sizeof(functions)) { memcpy(functions+flen,outln,ol); flen += ol; functions[flen]='\0'; }
+                                char outln[64]; snprintf(outln,sizeof(outln),"    else {\n"); size_t ol=strlen(outln); fn_append(outln, ol);
                             }
                         }
                         L = NL + 1;
                     }
                     // close function
-                    const char* fclos = "}\n"; size_t fc = strlen(fclos); if (flen + fc +1 < sizeof(functions)) { memcpy(functions+flen,fclos,fc); flen += fc; functions[flen]='\0'; }
+                    const char* fclos = "}\n"; size_t fc = strlen(fclos); fn_append(fclos, fc);
                     line = bodyend + 1; continue;
                 }
             }
@@ -461,7 +585,7 @@ static int parse_and_emit(const char* code, const char* tmpc, const char* modsdi
         scan = end + 1;
     }
     // emit preamble and functions and a main that calls entry function if found
-    write_preamble(out, 1);
+    write_preamble(out, need_time);
     // emit functions
     if (flen > 0) fprintf(out, "%s\n", functions);
     DEBUG_LOG("emitted %zu bytes of functions\n", flen);
@@ -478,7 +602,7 @@ static int parse_and_emit(const char* code, const char* tmpc, const char* modsdi
 
 int main(int argc, char** argv) {
     if (argc < 2) { 
-        fprintf(stderr, "Usage: %s <input.xf> [-o output] [--mods-dir <dir>] [--debug] [--keep-temp]\n", argv[0]); 
+        fprintf(stderr, "Usage: %s <input.xf|-> [-o output] [--mods-dir <dir>] [--debug] [--keep-temp] [--stdout-buffering=none|line|full] [--seed N]\n", argv[0]); 
         return 1; 
     }
     const char* infile = NULL; const char* outfile = NULL; const char* modsdir = "mods";
@@ -487,12 +611,26 @@ int main(int argc, char** argv) {
         else if (strcmp(argv[i], "--mods-dir")==0 && i+1<argc) modsdir = argv[++i];
         else if (strcmp(argv[i], "--debug")==0) g_debug = 1;
         else if (strcmp(argv[i], "--keep-temp")==0) g_keep_temp = 1;
-        else if (argv[i][0] == '-') { }
+        else if (strncmp(argv[i], "--stdout-buffering=", 19)==0) {
+            const char* m = argv[i] + 19;
+            if (strcmp(m, "none")==0) g_stdout_buffering = "_IONBF";
+            else if (strcmp(m, "line")==0) g_stdout_buffering = "_IOLBF";
+            else if (strcmp(m, "full")==0) g_stdout_buffering = "_IOFBF";
+            else { fprintf(stderr, "Unknown --stdout-buffering mode '%s' (expected none, line or full)\n", m); return 1; }
+        }
+        else if ((strncmp(argv[i], "--seed=", 7)==0) || (strcmp(argv[i], "--seed")==0 && i+1<argc)) {
+            const char* v = argv[i][6] == '=' ? argv[i] + 7 : argv[++i]; char* end = NULL;
+            errno = 0; g_seed = strtoull(v, &end, 0);
+            if (!*v || *end || errno || *v == '-') { fprintf(stderr, "--seed expects an unsigned 64-bit number, got '%s'\n", v); return 1; }
+            g_has_seed = 1;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] != '\0') { }
         else if (!infile) infile = argv[i];
     }
     if (!infile) { fprintf(stderr, "No input file\n"); return 1; }
     char tmpc[512]; snprintf(tmpc, sizeof(tmpc), "temp_%d.c", (int)GET_PID());
-    char outname[512]; if (!outfile) { const char* dot = strrchr(infile, '.'); size_t len = dot ? (size_t)(dot - infile): strlen(infile); if (len >= sizeof(outname)) len = sizeof(outname)-1; memcpy(outname, infile, len); outname[len]='\0'; outfile = outname; }
+    char outname[512]; if (!outfile && strcmp(infile, "-") == 0) outfile = "stdin";
+    if (!outfile) { const char* dot = strrchr(infile, '.'); size_t len = dot ? (size_t)(dot - infile): strlen(infile); if (len >= sizeof(outname)) len = sizeof(outname)-1; memcpy(outname, infile, len); outname[len]='\0'; outfile = outname; }
     DEBUG_LOG("infile='%s' outfile='%s' modsdir='%s'\n", infile, outfile, modsdir ? modsdir : "(null)");
     DEBUG_LOG("calling read_file_safely('%s')\n", infile);
     char* code = read_file_safely(infile); if (!code) { fprintf(stderr, "Cannot read %s\n", infile); return 1; }